@@ -0,0 +1,184 @@
+#!/usr/bin/env python3
+# Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+# Copyright (C) 2017  Michael Richters
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+"""Summarize a Qukeys event log (see src/Kaleidoscope/QukeysEventLog.h).
+
+Reads the binary stream either from a file captured earlier, or
+straight from the keyboard's serial port (which needs pyserial), and
+prints histograms of:
+
+  - dwell time: from a key's press until Qukeys resolved it, which is
+    the delay Qukeys added, split by the state it was resolved to
+  - hold time: from press to release, for qukeys resolved to each state
+
+With --trace, it writes the presses and releases out as a keystroke
+trace instead, which test/bench can replay.
+
+Usage:
+  qukeys_event_log.py capture.bin
+  qukeys_event_log.py --port /dev/ttyACM0 --seconds 600
+  qukeys_event_log.py --trace typing.trace capture.bin
+"""
+
+import argparse
+import collections
+import sys
+import time
+
+EVENT_PRESS, EVENT_RELEASE, EVENT_RESOLVE, EVENT_DROPPED = range(4)
+STATE_NAMES = {0: 'not a qukey', 1: 'primary', 2: 'alternate'}
+RECORD_SIZE = 4
+
+
+def parse_records(data):
+    """Yield (event, state, addr, time) tuples, skipping bytes until the
+    stream lines up with a record header again if it's been cut off."""
+    i = 0
+    while i + RECORD_SIZE <= len(data):
+        header = data[i]
+        if header & 0xF0 != 0xA0 or (header >> 2) & 0x03 == 3:
+            i += 1
+            continue
+        time_ms = data[i + 2] | (data[i + 3] << 8)
+        yield header & 0x03, (header >> 2) & 0x03, data[i + 1], time_ms
+        i += RECORD_SIZE
+
+
+def elapsed(start, end):
+    # Timestamps are 16 bits, so they wrap around every 65 seconds
+    return (end - start) & 0xFFFF
+
+
+def read_port(port, seconds):
+    import serial
+    with serial.Serial(port, 9600, timeout=0.5) as connection:
+        connection.write(b'qukeys.log 1\n')
+        # Skip Focus's reply to the command before the records start
+        connection.read_until(b'.\r\n')
+        data = bytearray()
+        deadline = time.time() + seconds
+        try:
+            while time.time() < deadline:
+                data += connection.read(256)
+        except KeyboardInterrupt:
+            pass
+        connection.write(b'qukeys.log 0\n')
+    return bytes(data)
+
+
+def write_trace(records, filename, cols):
+    """Write presses and releases as `<time> <p|r> <row> <col>` lines,
+    with the times unwrapped and starting from zero."""
+    with open(filename, 'w') as trace:
+        last = None
+        total = 0
+        for event, _, addr, time_ms in records:
+            if event not in (EVENT_PRESS, EVENT_RELEASE):
+                continue
+            if last is None:
+                last = time_ms
+            total += elapsed(last, time_ms)
+            last = time_ms
+            trace.write('%d %s %d %d\n' % (total, 'p' if event == EVENT_PRESS else 'r',
+                                          addr // cols, addr % cols))
+
+
+def histogram(title, values, bucket_width):
+    print(title)
+    if not values:
+        print('  (none)')
+        return
+    buckets = collections.Counter(v // bucket_width for v in values)
+    peak = max(buckets.values())
+    for bucket in range(max(buckets) + 1):
+        count = buckets.get(bucket, 0)
+        bar = '#' * (count * 50 // peak)
+        print('  %5d-%-5d %6d %s' % (bucket * bucket_width,
+                                      (bucket + 1) * bucket_width - 1, count, bar))
+    values = sorted(values)
+    print('  count %d, median %d, 95th percentile %d' %
+          (len(values), values[len(values) // 2], values[len(values) * 95 // 100]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('capture', nargs='?', help='file with a captured stream')
+    parser.add_argument('--port', help='read from this serial port instead')
+    parser.add_argument('--seconds', type=float, default=60,
+                        help='how long to record from the port')
+    parser.add_argument('--bucket', type=int, default=10,
+                        help='histogram bucket width in milliseconds')
+    parser.add_argument('--trace', metavar='FILE',
+                        help='write a keystroke trace for test/bench instead')
+    parser.add_argument('--cols', type=int, default=16,
+                        help='number of columns in the key matrix (for --trace)')
+    args = parser.parse_args()
+
+    if args.port:
+        data = read_port(args.port, args.seconds)
+    elif args.capture:
+        with open(args.capture, 'rb') as capture:
+            data = capture.read()
+    else:
+        parser.error('give a capture file or --port')
+
+    if args.trace:
+        write_trace(parse_records(data), args.trace, args.cols)
+        return 0
+
+    pressed = {}   # addr -> press time
+    resolved = {}  # addr -> state it was resolved to
+    released = {}  # addr -> release time, for keys released before they were resolved
+    dwell = collections.defaultdict(list)
+    hold = collections.defaultdict(list)
+    dropped = 0
+
+    for event, state, addr, time_ms in parse_records(data):
+        if event == EVENT_PRESS:
+            pressed[addr] = time_ms
+            resolved.pop(addr, None)
+            released.pop(addr, None)
+        elif event == EVENT_RESOLVE:
+            if addr not in pressed:
+                continue
+            dwell[state].append(elapsed(pressed[addr], time_ms))
+            resolved[addr] = state
+            # A tap is released first, and resolved as a result
+            if addr in released:
+                hold[state].append(elapsed(pressed.pop(addr), released.pop(addr)))
+        elif event == EVENT_RELEASE:
+            # Keys pressed before logging started have no press record
+            if addr not in pressed:
+                continue
+            if addr in resolved:
+                hold[resolved[addr]].append(elapsed(pressed.pop(addr), time_ms))
+            else:
+                released[addr] = time_ms
+        elif event == EVENT_DROPPED:
+            dropped += time_ms
+
+    for state in sorted(STATE_NAMES):
+        histogram('Dwell time (ms), %s:' % STATE_NAMES[state], dwell[state], args.bucket)
+    for state in (1, 2):
+        histogram('Hold time (ms), %s:' % STATE_NAMES[state], hold[state], args.bucket)
+    if dropped:
+        print('%d records were dropped' % dropped)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
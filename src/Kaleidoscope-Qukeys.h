@@ -19,3 +19,5 @@
 #pragma once
 
 #include <Kaleidoscope/Qukeys.h>
+#include <Kaleidoscope/QukeysStats.h>
+#include <Kaleidoscope/QukeysEventLog.h>
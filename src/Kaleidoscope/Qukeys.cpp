@@ -20,10 +20,24 @@
 #include <Kaleidoscope-Qukeys.h>
 #include <kaleidoscope/hid.h>
 #include <MultiReport/Keyboard.h>
+#ifndef QUKEYS_DISABLE_DUAL_USE
 #include <Kaleidoscope-Ranges.h>
+#endif
 #include <key_defs_keymaps.h>
 
-#ifdef ARDUINO_VIRTUAL
+// On the virtual hardware, Qukeys traces the queue, one event per
+// line, so a test harness replaying keystrokes can follow what it did:
+//   qukeys enqueue <addr> <time>
+//   qukeys overflow
+//   qukeys flush <addr> <state> <dwell time>
+//   qukeys combo <index>
+//   qukeys report
+//   qukeys invariant <name>
+// where <state> is 0 (not a qukey), 1 (primary) or 2 (alternate),
+// "report" means a flush sent a HID report, and "invariant" means the
+// queue's bookkeeping was found to be inconsistent at the end of a
+// cycle (see checkInvariants()).
+#if defined(ARDUINO_VIRTUAL) && !defined(QUKEYS_DISABLE_TRACE)
 #define debug_print(...) printf(__VA_ARGS__)
 #else
 #define debug_print(...)
@@ -32,151 +46,435 @@
 
 namespace kaleidoscope {
 
-bool isDualUse(Key k) {
-  if (k.raw < ranges::DU_FIRST || k.raw > ranges::DU_LAST)
-    return false;
-  return true;
-}
-
-Key getDualUsePrimaryKey(Key k) {
-  if (k.raw >= ranges::DUM_FIRST && k.raw <= ranges::DUM_LAST) {
+// Decode a keycode's DualUse primary and alternate keycodes (if it is
+// one), checking the ranges only once
+KeyClass classifyKeycode(Key k) {
+  KeyClass key_class;
+  key_class.kind = keycodeKind(k);
+  key_class.primary = k;
+#ifndef QUKEYS_DISABLE_DUAL_USE
+  if (key_class.kind == QUKEY_KIND_PLAIN)
+    return key_class;
+  Key alternate;
+  if (key_class.kind == QUKEY_KIND_DUAL_USE_MODIFIER) {
     k.raw -= ranges::DUM_FIRST;
-    k.flags = 0;
-  } else if (k.raw >= ranges::DUL_FIRST && k.raw <= ranges::DUL_LAST) {
-    k.raw -= ranges::DUL_FIRST;
-    k.flags = 0;
-  }
-  return k;
-}
-
-Key getDualUseAlternateKey(Key k) {
-  if (k.raw >= ranges::DUM_FIRST && k.raw <= ranges::DUM_LAST) {
-    k.raw -= ranges::DUM_FIRST;
-    k.raw = (k.raw >> 8) + Key_LeftControl.keyCode;
-  } else if (k.raw >= ranges::DUL_FIRST && k.raw <= ranges::DUL_LAST) {
+    alternate.raw = (k.raw >> 8) + Key_LeftControl.keyCode;
+  } else {
     k.raw -= ranges::DUL_FIRST;
     byte layer = k.flags;
     // Should be `ShiftToLayer(layer)`, but that gives "narrowing conversion"
     // warnings that I can't figure out how to resolve
-    k.keyCode = layer + LAYER_SHIFT_OFFSET;
-    k.flags = KEY_FLAGS | SYNTHETIC | SWITCH_TO_KEYMAP;
+    alternate.keyCode = layer + LAYER_SHIFT_OFFSET;
+    alternate.flags = KEY_FLAGS | SYNTHETIC | SWITCH_TO_KEYMAP;
   }
-  return k;
+  k.flags = 0;
+  key_class.primary = k;
+  key_class.alternate = alternate;
+#endif
+  return key_class;
 }
 
 
-Qukey::Qukey(int8_t layer, byte row, byte col, Key alt_keycode) {
-  this->layer = layer;
-  this->addr = addr::addr(row, col);
-  this->alt_keycode = alt_keycode;
-}
-
 Qukey * Qukeys::qukeys;
 uint8_t Qukeys::qukeys_count = 0;
+bool Qukeys::qukeys_in_progmem = false;
+QukeyCombo * Qukeys::combos;
+uint8_t Qukeys::combos_count = 0;
 
+uint32_t Qukeys::cycle_time_ = 0;
+#ifdef ARDUINO_VIRTUAL
+uint32_t (*Qukeys::clock_)(void) = NULL;
+#endif
+#ifndef QUKEYS_DISABLE_ACTIVATION
 bool Qukeys::active_ = true;
+#endif
+uint8_t Qukeys::resolution_policy_ = QUKEYS_RESOLVE_ON_RELEASE;
+uint8_t Qukeys::overflow_policy_ = QUKEYS_OVERFLOW_FLUSH_PRIMARY;
+uint16_t Qukeys::overflow_count_ = 0;
 uint16_t Qukeys::time_limit_ = 250;
+uint16_t Qukeys::adaptive_min_time_limit_ = 0;
+uint16_t Qukeys::adaptive_max_time_limit_ = 0;
+bool Qukeys::timeout_pending_ = false;
+uint32_t Qukeys::timeout_deadline_;
+uint16_t Qukeys::quick_tap_timeout_ = 0;
+uint8_t Qukeys::quick_tap_addr_ = QUKEY_UNKNOWN_ADDR;
+uint16_t Qukeys::quick_tap_time_;
+uint16_t Qukeys::tap_time_average_ = 0;
+uint8_t Qukeys::dual_use_modifier_timeout_ = 0;
+uint8_t Qukeys::dual_use_layer_timeout_ = 0;
 QueueItem Qukeys::key_queue_[] = {};
+uint8_t Qukeys::key_queue_head_ = 0;
 uint8_t Qukeys::key_queue_length_ = 0;
 byte Qukeys::qukey_state_[] = {};
+uint8_t Qukeys::queued_keys_[] = {};
+QukeyResolveCallback Qukeys::resolve_callback_ = NULL;
+uint8_t Qukeys::qukey_index_[] = {};
+uint16_t Qukeys::combo_timeout_ = 50;
+uint8_t Qukeys::combo_keys_[] = {};
+uint8_t Qukeys::combo_held_[] = {};
+uint32_t Qukeys::active_combos_ = 0;
 bool Qukeys::flushing_queue_ = false;
+uint8_t Qukeys::flush_start_ = 0;
+uint8_t Qukeys::flush_count_ = 0;
+HID_KeyboardReport_Data_t Qukeys::saved_report_;
 
 // Empty constructor; nothing is stored at the instance level
 Qukeys::Qukeys(void) {}
 
+void Qukeys::indexQukeys(void) {
+  for (uint8_t i = 0; i < TOTAL_KEYS; i++) {
+    qukey_index_[i] = QUKEY_NO_INDEX;
+  }
+  for (uint8_t i = 0; i < qukeys_count && i < QUKEYS_TABLE_MAX; i++) {
+    uint8_t key_addr = getQukeyAddr(i);
+    if (key_addr >= TOTAL_KEYS)
+      continue;
+    if (qukey_index_[key_addr] == QUKEY_NO_INDEX) {
+      qukey_index_[key_addr] = i;
+    } else {
+      qukey_index_[key_addr] |= QUKEY_INDEX_MULTIPLE;
+    }
+  }
+
+  for (uint8_t i = 0; i < QUKEYS_BITFIELD_SIZE; i++) {
+    combo_keys_[i] = 0;
+  }
+  for (uint8_t i = 0; i < combos_count && i < QUKEYS_COMBOS_MAX; i++) {
+    for (uint8_t j = 0; j < QUKEY_COMBO_MAX_KEYS; j++) {
+      uint8_t key_addr = combos[i].addrs[j];
+      if (key_addr < TOTAL_KEYS)
+        bitSet(combo_keys_[key_addr / 8], key_addr % 8);
+    }
+  }
+
+  // Keys waiting in the queue have the old qukey indices cached
+  reclassifyQueue();
+  scheduleTimeout();
+}
+
 int8_t Qukeys::lookupQukey(uint8_t key_addr) {
-  if (key_addr == QUKEY_UNKNOWN_ADDR) {
+  if (key_addr >= TOTAL_KEYS) {
     return QUKEY_NOT_FOUND;
   }
-  for (int8_t i = 0; i < qukeys_count; i++) {
-    if (qukeys[i].addr == key_addr) {
-      byte row = addr::row(key_addr);
-      byte col = addr::col(key_addr);
-      if ((qukeys[i].layer == QUKEY_ALL_LAYERS) ||
-          (qukeys[i].layer == Layer.lookupActiveLayer(row, col))) {
-        return i;
-      }
+  uint8_t index_entry = qukey_index_[key_addr];
+  if (index_entry == QUKEY_NO_INDEX) {
+    return QUKEY_NOT_FOUND;
+  }
+  uint8_t i = index_entry & ~QUKEY_INDEX_MULTIPLE;
+  qukey_layer_mask_t layer_bit = 0;
+#ifndef QUKEYS_DISABLE_LAYER_MATCHING
+  layer_bit = qukeyLayerBit(Layer.lookupActiveLayer(addr::row(key_addr), addr::col(key_addr)));
+#endif
+  // The common case: only one qukey for this keyswitch
+  if (!(index_entry & QUKEY_INDEX_MULTIPLE)) {
+    if (qukeyMatchesLayer(i, layer_bit))
+      return i;
+    return QUKEY_NOT_FOUND;
+  }
+  // Otherwise, check the remaining entries for this keyswitch in order
+  // (the counter is unsigned, so it can't wrap around to a negative
+  // index)
+  for (; i < qukeys_count && i < QUKEYS_TABLE_MAX; i++) {
+    if (getQukeyAddr(i) == key_addr && qukeyMatchesLayer(i, layer_bit)) {
+      return i;
     }
   }
   return QUKEY_NOT_FOUND;
 }
 
-void Qukeys::enqueue(uint8_t key_addr) {
+// Store the keycode and qukey (if any) of a queued key, so the flush
+// and timeout paths don't have to look them up again
+void Qukeys::classifyKey(QueueItem &item, Key keycode, uint8_t kind, int8_t qukey_index) {
+#ifndef QUKEYS_COMPACT_QUEUE
+  item.key = keycode;
+#endif
+  switch (kind) {
+  case QUKEY_KIND_DUAL_USE_MODIFIER:
+    item.qukey_index = QUKEY_DUAL_USE_MODIFIER;
+    break;
+  case QUKEY_KIND_DUAL_USE_LAYER:
+    item.qukey_index = QUKEY_DUAL_USE_LAYER;
+    break;
+  default:
+    item.qukey_index = qukey_index;
+  }
+}
+
+// If flushing a key changed the active layers, the keys still in the
+// queue (which were pressed after it) need to be looked up again.
+// Layer.lookup() only returns what the live keymap cached when the key
+// was pressed, so that has to be brought up to date first.
+void Qukeys::reclassifyQueue(void) {
+  for (uint8_t i = 0; i < key_queue_length_; i++) {
+    QueueItem &item = queueItem(i);
+    if (item.qukey_index == QUKEY_QUICK_TAP)
+      continue;
+    byte row = addr::row(item.addr);
+    byte col = addr::col(item.addr);
+    Layer.updateLiveCompositeKeymap(row, col);
+    Key keycode = Layer.lookup(row, col);
+    classifyKey(item, keycode, keycodeKind(keycode), lookupQukey(item.addr));
+  }
+}
+
+void Qukeys::enqueue(uint8_t key_addr, Key mapped_key, uint8_t kind, int8_t qukey_index) {
   if (key_queue_length_ == QUKEYS_QUEUE_MAX) {
-    flushKey(QUKEY_STATE_PRIMARY, IS_PRESSED | WAS_PRESSED);
+    overflow_count_++;
+    debug_print("qukeys overflow\n");
+    beginFlush();
+    if (overflow_policy_ == QUKEYS_OVERFLOW_FLUSH_ALTERNATE) {
+      flushKey(QUKEY_STATE_ALTERNATE, IS_PRESSED | WAS_PRESSED);
+    } else {
+      flushKey(QUKEY_STATE_PRIMARY, IS_PRESSED | WAS_PRESSED);
+    }
     flushQueue();
+    endFlush();
   }
-  key_queue_[key_queue_length_].addr = key_addr;
-  key_queue_[key_queue_length_].start_time = (uint16_t)millis();
+  QueueItem &item = queueItem(key_queue_length_);
+  item.addr = key_addr;
+  item.start_time = queueTime();
+  classifyKey(item, mapped_key, kind, qukey_index);
   key_queue_length_++;
-  addr::mask(key_addr);
+  // A key that can't be part of a combo ends the wait for one, so with
+  // combos defined, the deadline can change with every key
+  if (key_queue_length_ == 1 || combos_count != 0)
+    scheduleTimeout();
+  debug_print("qukeys enqueue %d %u\n", key_addr, (uint16_t)cycle_time_);
+  bitSet(queued_keys_[key_addr / 8], key_addr % 8);
 }
 
-int8_t Qukeys::searchQueue(uint8_t key_addr) {
-  for (int8_t i = 0; i < key_queue_length_; i++) {
-    if (key_queue_[i].addr == key_addr)
-      return i;
+bool Qukeys::comboHasKey(uint8_t combo_index, uint8_t key_addr) {
+  for (uint8_t j = 0; j < QUKEY_COMBO_MAX_KEYS; j++) {
+    if (combos[combo_index].addrs[j] == key_addr)
+      return true;
+  }
+  return false;
+}
+
+// Check if the keys in the queue could still be the start of a combo,
+// in which case they wait there until the combo time limit runs out
+bool Qukeys::comboPending(void) {
+  if (combos_count == 0 || key_queue_length_ == 0 ||
+      queueDwellTime(queueItem(0), queueTime()) > combo_timeout_)
+    return false;
+  for (uint8_t i = 0; i < key_queue_length_; i++) {
+    if (!isComboKey(queueItem(i).addr))
+      return false;
+  }
+  return true;
+}
+
+// Check if pressing `key_addr` completes a combo. That happens if the
+// other keys of the combo are the only ones in the queue, and were all
+// pressed within the time limit. If so, they're taken out of the queue,
+// and the combo's index is returned.
+int8_t Qukeys::completeCombo(uint8_t key_addr) {
+  if (key_queue_length_ == 0 || key_queue_length_ >= QUKEY_COMBO_MAX_KEYS ||
+      queueDwellTime(queueItem(0), queueTime()) > combo_timeout_)
+    return QUKEY_NOT_FOUND;
+  for (uint8_t i = 0; i < combos_count && i < QUKEYS_COMBOS_MAX; i++) {
+    if (!comboHasKey(i, key_addr))
+      continue;
+    uint8_t combo_key_count = 1;
+    bool complete = true;
+    for (uint8_t j = 0; j < QUKEY_COMBO_MAX_KEYS; j++) {
+      uint8_t combo_key_addr = combos[i].addrs[j];
+      if (combo_key_addr >= TOTAL_KEYS || combo_key_addr == key_addr)
+        continue;
+      combo_key_count++;
+      if (searchQueue(combo_key_addr) == QUKEY_NOT_FOUND) {
+        complete = false;
+        break;
+      }
+    }
+    if (!complete || combo_key_count != key_queue_length_ + 1)
+      continue;
+
+    // The combo's keys now belong to it until they're released
+    for (uint8_t j = 0; j < key_queue_length_; j++) {
+      uint8_t queued_addr = queueItem(j).addr;
+      bitClear(queued_keys_[queued_addr / 8], queued_addr % 8);
+      bitSet(combo_held_[queued_addr / 8], queued_addr % 8);
+    }
+    bitSet(combo_held_[key_addr / 8], key_addr % 8);
+    bitSet(active_combos_, i);
+    key_queue_length_ = 0;
+    scheduleTimeout();
+    debug_print("qukeys combo %d\n", i);
+    return i;
   }
   return QUKEY_NOT_FOUND;
 }
 
-// flush a single entry from the head of the queue
-void Qukeys::flushKey(bool qukey_state, uint8_t keyswitch_state) {
-  addr::unmask(key_queue_[0].addr);
-  int8_t qukey_index = lookupQukey(key_queue_[0].addr);
-  bool is_qukey = (qukey_index != QUKEY_NOT_FOUND);
-  byte row = addr::row(key_queue_[0].addr);
-  byte col = addr::col(key_queue_[0].addr);
-  bool is_dual_use = isDualUse(Layer.lookup(row, col));
+// Keys that completed a combo produce its keycode until one of them is
+// released, after which the others are ignored until they're released
+Key Qukeys::comboKeyScan(uint8_t key_addr, uint8_t key_state) {
   Key keycode = Key_NoKey;
-  if (is_qukey || is_dual_use) {
-    setQukeyState(key_queue_[0].addr, qukey_state);
-    if (qukey_state == QUKEY_STATE_ALTERNATE) {
-      if (is_dual_use) {
-        keycode = getDualUseAlternateKey(keycode);
-      } else { // is_qukey
-        keycode = qukeys[qukey_index].alt_keycode;
-      }
+  for (uint8_t i = 0; i < combos_count && i < QUKEYS_COMBOS_MAX; i++) {
+    if (bitRead(active_combos_, i) && comboHasKey(i, key_addr)) {
+      keycode = combos[i].keycode;
+      if (keyToggledOff(key_state))
+        bitClear(active_combos_, i);
+      break;
     }
   }
+  if (keyToggledOff(key_state))
+    bitClear(combo_held_[key_addr / 8], key_addr % 8);
+  return keycode;
+}
 
-  // Before calling handleKeyswitchEvent() below, make sure Qukeys knows not to handle
-  // these events:
-  flushing_queue_ = true;
+int8_t Qukeys::searchQueue(uint8_t key_addr) {
+  for (int8_t i = 0; i < key_queue_length_; i++) {
+    if (queueItem(i).addr == key_addr)
+      return i;
+  }
+  return QUKEY_NOT_FOUND;
+}
 
-  // Since we're in the middle of the key scan, we don't necessarily
-  // have a full HID report, and we don't want to accidentally turn
-  // off keys that the scan hasn't reached yet, so we force the
-  // current report to be the same as the previous one, then proceed
-  HID_KeyboardReport_Data_t hid_report;
+// Get the keycode to inject for a key flushed from the queue, once its
+// qukey state has been set. DualUse keys are decoded by keyScanHook().
+Key Qukeys::flushedKeycode(const QueueItem &item) {
+  if (item.qukey_index >= 0 &&
+      getQukeyState(item.addr) == QUKEY_STATE_ALTERNATE)
+    return getQukey(item.qukey_index).alt_keycode;
+#ifdef QUKEYS_COMPACT_QUEUE
+  // The live keymap still has the key from when it was pressed (or from
+  // reclassifyQueue(), after a layer change)
+  return Layer.lookup(addr::row(item.addr), addr::col(item.addr));
+#else
+  return item.key;
+#endif
+}
+
+// Check if the current report has the bit for an ordinary keycode set
+// (anything else returns false)
+bool Qukeys::reportHasKey(Key keycode) {
+  if (keycode.flags != KEY_FLAGS)
+    return false;
+  uint8_t k = keycode.keyCode;
+  if (k >= Key_LeftControl.keyCode && k <= Key_LeftControl.keyCode + 7)
+    return bitRead(Keyboard.keyReport.modifiers, k - Key_LeftControl.keyCode);
+  if (k >= Key_LeftControl.keyCode)
+    return false;
+  return bitRead(Keyboard.keyReport.keys[k / 8], k % 8);
+}
+
+// Start flushing keys from the queue. Since we're (probably) in the
+// middle of the key scan, we don't necessarily have a full HID report,
+// and we don't want to accidentally turn off keys that the scan hasn't
+// reached yet, so we save the current report and force it to be the
+// same as the previous one. This is done once for any number of
+// flushKey() calls, until endFlush() restores it.
+void Qukeys::beginFlush(void) {
+  // Before calling handleKeyswitchEvent() in flushKey(), make sure
+  // Qukeys knows not to handle these events:
+  flushing_queue_ = true;
+  flush_start_ = key_queue_head_;
+  flush_count_ = 0;
   // First, save the current report
-  memcpy(hid_report.allkeys, Keyboard.keyReport.allkeys, sizeof(hid_report));
+  memcpy(saved_report_.allkeys, Keyboard.keyReport.allkeys, sizeof(saved_report_));
   // Next, copy the old report
   memcpy(Keyboard.keyReport.allkeys, Keyboard.lastKeyReport.allkeys, sizeof(Keyboard.keyReport));
+}
+
+// Finish flushing keys: restore the current report, then add the
+// flushed keys that are still held back into it.
+void Qukeys::endFlush(void) {
+  memcpy(Keyboard.keyReport.allkeys, saved_report_.allkeys, sizeof(saved_report_));
+
+  // The flushed entries are still in the key_queue_ array, just behind
+  // its head; flushKey() marks the ones that were released
+  uint8_t i = flush_start_;
+  while (flush_count_ > 0) {
+    const QueueItem &item = key_queue_[i];
+    if (item.addr != QUKEY_UNKNOWN_ADDR) {
+      handleKeyswitchEvent(flushedKeycode(item), addr::row(item.addr),
+                           addr::col(item.addr), IS_PRESSED | WAS_PRESSED);
+    }
+    if (++i == QUKEYS_QUEUE_MAX)
+      i = 0;
+    flush_count_--;
+  }
+
+  // Now that we're done sending the report(s), Qukeys can process events again:
+  flushing_queue_ = false;
+}
+
+// flush a single entry from the head of the queue; this must be called
+// between beginFlush() and endFlush()
+void Qukeys::flushKey(bool qukey_state, uint8_t keyswitch_state) {
+  QueueItem &item = queueItem(0);
+  uint8_t key_addr = item.addr;
+  bitClear(queued_keys_[key_addr / 8], key_addr % 8);
+  byte row = addr::row(key_addr);
+  byte col = addr::col(key_addr);
+  bool is_qukey = isQukey(item);
+  if (is_qukey) {
+    setQukeyState(key_addr, qukey_state);
+    if (qukey_state == QUKEY_STATE_ALTERNATE) {
+      QUKEYS_STATS_COUNT(alternate_count);
+    } else {
+      QUKEYS_STATS_COUNT(primary_count);
+    }
+  }
+  Key keycode = flushedKeycode(item);
+  uint16_t dwell_time = queueDwellTime(item, queueTime());
+  // A qukey released before it was resolved was tapped
+  if (is_qukey && qukey_state == QUKEY_STATE_PRIMARY && !(keyswitch_state & IS_PRESSED)) {
+    recordTap(dwell_time);
+    quick_tap_addr_ = key_addr;
+    quick_tap_time_ = cycle_time_;
+  }
+  QUKEYS_STATS_DWELL(dwell_time);
+  debug_print("qukeys flush %d %d %u\n", key_addr,
+              is_qukey ? 1 + qukey_state : 0, dwell_time);
+  QUKEYS_EVENT_LOG(RESOLVE, key_addr, is_qukey ? 1 + qukey_state : 0, cycle_time_);
+  if (is_qukey && resolve_callback_ != NULL) {
+    Key resolved_keycode = keycode;
+    if (item.qukey_index < 0) {
+      KeyClass key_class = classifyKeycode(keycode);
+      resolved_keycode = (qukey_state == QUKEY_STATE_ALTERNATE) ?
+                         key_class.alternate : key_class.primary;
+    }
+    (*resolve_callback_)(row, col, resolved_keycode, qukey_state, dwell_time);
+  }
+
   // Instead of just calling pressKey here, we start processing the
   // key again, as if it was just pressed, and mark it as injected, so
   // we can ignore it and don't start an infinite loop. It would be
   // nice if we could use key_state to also indicate which plugin
   // injected the key.
+  uint32_t layer_state = Layer.getLayerState();
+  bool was_in_report = reportHasKey(keycode);
   handleKeyswitchEvent(keycode, row, col, IS_PRESSED);
-  // Now we send the report (if there were any changes)
-  hid::sendKeyboardReport();
-
-  // Next, we restore the current state of the report
-  memcpy(Keyboard.keyReport.allkeys, hid_report.allkeys, sizeof(hid_report));
-
-  // Last, if the key is still down, add its code back in
-  if (keyswitch_state | IS_PRESSED)
-    handleKeyswitchEvent(keycode, row, col, IS_PRESSED | WAS_PRESSED);
+  // Now we send the report, but only if the key changed it (it might
+  // have been a layer shift, for example). Until now, the report has
+  // been the same as the last one sent, so if it's an ordinary keycode
+  // whose bit just got set, that's all we need to check.
+  if ((!was_in_report && reportHasKey(keycode)) ||
+      memcmp(Keyboard.keyReport.allkeys, Keyboard.lastKeyReport.allkeys,
+             sizeof(Keyboard.keyReport)) != 0) {
+    hid::sendKeyboardReport();
+    debug_print("qukeys report\n");
+  }
 
-  // Now that we're done sending the report(s), Qukeys can process events again:
-  flushing_queue_ = false;
+  // If the key is no longer down, mark its entry so endFlush() doesn't
+  // add its code back in
+  if (!(keyswitch_state & IS_PRESSED))
+    item.addr = QUKEY_UNKNOWN_ADDR;
+  flush_count_++;
 
-  // Shift the queue, so key_queue[0] is always the first key that gets processed
-  for (byte i = 0; i < key_queue_length_; i++) {
-    key_queue_[i] = key_queue_[i + 1];
-  }
+  // Advance the head of the queue, so queueItem(0) is always the first
+  // key that gets processed
+  if (++key_queue_head_ == QUKEYS_QUEUE_MAX)
+    key_queue_head_ = 0;
   key_queue_length_--;
+
+  // If the flushed key was a layer shift, the keys pressed after it
+  // belong to the new layer
+  if (Layer.getLayerState() != layer_state)
+    reclassifyQueue();
+  scheduleTimeout();
 }
 
 // flushQueue() is called when a key that's in the key_queue is
@@ -186,63 +484,202 @@ void Qukeys::flushKey(bool qukey_state, uint8_t keyswitch_state) {
 void Qukeys::flushQueue(int8_t index) {
   if (index == QUKEY_NOT_FOUND)
     return;
+  // With QUKEYS_RESOLVE_BY_HAND, overlapping keys on the same hand are
+  // a roll, so qukeys on that hand keep their primary keycodes. They
+  // can't wait for the timeout instead, because the released key has
+  // to be flushed now.
+  bool by_hand = (resolution_policy_ == QUKEYS_RESOLVE_BY_HAND);
+  bool released_right_hand = isRightHand(queueItem(index).addr);
+  beginFlush();
   for (int8_t i = 0; i < index; i++) {
     if (key_queue_length_ == 0)
       break;
-    flushKey(QUKEY_STATE_ALTERNATE, IS_PRESSED | WAS_PRESSED);
+    if (by_hand && isRightHand(queueItem(0).addr) == released_right_hand) {
+      flushKey(QUKEY_STATE_PRIMARY, IS_PRESSED | WAS_PRESSED);
+    } else {
+      flushKey(QUKEY_STATE_ALTERNATE, IS_PRESSED | WAS_PRESSED);
+    }
   }
   flushKey(QUKEY_STATE_PRIMARY, WAS_PRESSED);
+  endFlush();
+}
+
+// Check if a queued qukey's alternate keycode is a layer shift
+bool Qukeys::hasLayerAlternate(const QueueItem &item) {
+  if (item.qukey_index == QUKEY_DUAL_USE_LAYER)
+    return true;
+  if (item.qukey_index < 0)
+    return false;
+  Key keycode = getQukey(item.qukey_index).alt_keycode;
+  return (keycode.flags & (SYNTHETIC | SWITCH_TO_KEYMAP)) == (SYNTHETIC | SWITCH_TO_KEYMAP);
 }
 
-// Flush all the non-qukey keys from the front of the queue
+// Check if the key that was just added to the end of the queue should
+// resolve the qukeys ahead of it, according to the resolution policy
+bool Qukeys::resolvesOnPress(void) {
+  if (key_queue_length_ < 2)
+    return false;
+  switch (resolution_policy_) {
+  case QUKEYS_RESOLVE_ON_PRESS:
+    return true;
+  case QUKEYS_RESOLVE_LAYERS_ON_PRESS:
+    return hasLayerAlternate(queueItem(0));
+  case QUKEYS_RESOLVE_BY_HAND:
+    return (isRightHand(queueItem(0).addr) !=
+            isRightHand(queueItem(key_queue_length_ - 1).addr));
+  default:
+    return false;
+  }
+}
+
+// Flush the first `count` keys from the queue in their alternate
+// states, then any non-qukeys behind them. Unlike flushQueue(index),
+// the key that triggered this is still held.
+void Qukeys::resolveQueue(uint8_t count) {
+  beginFlush();
+  while (count-- > 0)
+    flushKey(QUKEY_STATE_ALTERNATE, IS_PRESSED | WAS_PRESSED);
+  flushQueue();
+  endFlush();
+}
+
+// Flush all the non-qukey keys from the front of the queue; this must
+// be called between beginFlush() and endFlush()
 void Qukeys::flushQueue(void) {
-  // flush keys until we find a qukey:
+  // flush keys until we find a qukey (or DualUse key), or keys that
+  // might be part of a combo:
   while (key_queue_length_ > 0 &&
-         lookupQukey(key_queue_[0].addr) == QUKEY_NOT_FOUND) {
+         !isQukey(queueItem(0)) &&
+         !comboPending()) {
     flushKey(QUKEY_STATE_PRIMARY, IS_PRESSED | WAS_PRESSED);
   }
 }
 
 Key Qukeys::keyScanHook(Key mapped_key, byte row, byte col, uint8_t key_state) {
 
-  // If Qukeys is turned off, continue to next plugin
-  if (!active_)
-    return getDualUsePrimaryKey(mapped_key);
+  // Every call from the scan is timed, including the fast path, but not
+  // the ones injected while flushing the queue, which are part of it
+  QUKEYS_STATS_TIME_OUTER_HOOK(scan_timing, flushing_queue_);
+
+  bool is_dual_use = (keycodeKind(mapped_key) != QUKEY_KIND_PLAIN);
+
+#ifndef QUKEYS_DISABLE_ACTIVATION
+  // If Qukeys is turned off, continue to next plugin. Keys that were
+  // queued before that still have to go through, though, so it keeps
+  // handling every key until the queue is empty.
+  if (!active_ && key_queue_length_ == 0)
+    return is_dual_use ? classifyKeycode(mapped_key).primary : mapped_key;
+#endif
 
-  // get key addr & qukey (if any)
   uint8_t key_addr = addr::addr(row, col);
+
+  // Log every press and release, including the ones that take the fast
+  // path below, but not the events injected by flushing the queue
+  if (!flushing_queue_) {
+    if (keyToggledOn(key_state)) {
+      QUKEYS_EVENT_LOG(PRESS, key_addr, 0, cycle_time_);
+    } else if (keyToggledOff(key_state)) {
+      QUKEYS_EVENT_LOG(RELEASE, key_addr, 0, cycle_time_);
+    }
+  }
+
+  // If nothing is queued, and there's no qukey on this keyswitch, this
+  // is just an ordinary key (unless it's a DualUse key), so proceed
+  if (key_queue_length_ == 0 && !hasQukey(key_addr) && !is_dual_use &&
+      !isComboKey(key_addr)) {
+    // Typing something else ends the quick tap window
+    if (keyToggledOn(key_state))
+      quick_tap_addr_ = QUKEY_UNKNOWN_ADDR;
+    return mapped_key;
+  }
+
+  // Keys waiting in the queue are ignored until they're released. This
+  // is what masking them in the hardware would do, without the calls.
+  if (keyIsPressed(key_state) && !keyToggledOn(key_state) &&
+      bitRead(queued_keys_[key_addr / 8], key_addr % 8))
+    return Key_NoKey;
+
+  // Decode the keycode once; everything below works from this
+  KeyClass key_class = classifyKeycode(mapped_key);
+
+  // get qukey (if any)
   int8_t qukey_index = lookupQukey(key_addr);
 
   // If the key was injected (from the queue being flushed)
   if (flushing_queue_) {
     // If it's a DualUse key, we still need to update its keycode
-    if (isDualUse(mapped_key)) {
+    if (is_dual_use) {
       if (getQukeyState(key_addr) == QUKEY_STATE_ALTERNATE) {
-        return getDualUseAlternateKey(mapped_key);
+        return key_class.alternate;
       } else {
-        return getDualUsePrimaryKey(mapped_key);
+        return key_class.primary;
       }
     }
     // ...otherwise, just continue to the next plugin
     return mapped_key;
   }
 
+  // Keys that completed a combo are handled separately until they're released
+  if (isComboHeld(key_addr))
+    return comboKeyScan(key_addr, key_state);
+
   // If the key isn't active, and didn't just toggle off, continue to next plugin
   if (!keyIsPressed(key_state) && !keyWasPressed(key_state))
-    return getDualUsePrimaryKey(mapped_key);
+    return key_class.primary;
 
   // If the key was just pressed:
   if (keyToggledOn(key_state)) {
+    // If a qukey was just tapped, pressing it again repeats its primary
+    // keycode, without waiting to see if it's held. It still has to go
+    // through the queue if there are keys ahead of it.
+    if (quick_tap_timeout_ != 0 && (qukey_index != QUKEY_NOT_FOUND || is_dual_use)) {
+      if (isQuickTap(key_addr)) {
+        setQukeyState(key_addr, QUKEY_STATE_PRIMARY);
+        if (resolve_callback_ != NULL)
+          (*resolve_callback_)(row, col, key_class.primary, QUKEY_STATE_PRIMARY, 0);
+        QUKEYS_EVENT_LOG(RESOLVE, key_addr, 1 + QUKEY_STATE_PRIMARY, cycle_time_);
+        if (key_queue_length_ == 0)
+          return key_class.primary;
+        enqueue(key_addr, key_class.primary, QUKEY_KIND_PLAIN, QUKEY_QUICK_TAP);
+        return Key_NoKey;
+      }
+    }
+    if (key_addr != quick_tap_addr_)
+      quick_tap_addr_ = QUKEY_UNKNOWN_ADDR;
+
     // If the queue is empty and the key isn't a qukey, proceed:
     if (key_queue_length_ == 0 &&
-        ! isDualUse(mapped_key) &&
-        qukey_index == QUKEY_NOT_FOUND) {
+        !is_dual_use &&
+        qukey_index == QUKEY_NOT_FOUND &&
+        !isComboKey(key_addr)) {
+      return mapped_key;
+    }
+
+    // If the key completes a combo with the keys in the queue, it
+    // produces the combo's keycode instead
+    if (isComboKey(key_addr)) {
+      int8_t combo_index = completeCombo(key_addr);
+      if (combo_index != QUKEY_NOT_FOUND)
+        return combos[combo_index].keycode;
+    }
+
+    // If the queue is full, an ordinary key can skip it, rather than
+    // forcing a flush (at the cost of being out of order)
+    if (key_queue_length_ == QUKEYS_QUEUE_MAX &&
+        overflow_policy_ == QUKEYS_OVERFLOW_PASS_THROUGH &&
+        qukey_index == QUKEY_NOT_FOUND && !is_dual_use) {
+      overflow_count_++;
       return mapped_key;
     }
 
     // Otherwise, queue the key and stop processing:
-    enqueue(key_addr);
-    // flushQueue() has already handled this key release
+    enqueue(key_addr, mapped_key, key_class.kind, qukey_index);
+    // Depending on the resolution policy, the keypress might be enough
+    // to give the keys ahead of it in the queue their alternate
+    // keycodes. The new key gets flushed too (if it's not a qukey), and
+    // picks up its keycode from any layer change that caused.
+    if (resolvesOnPress())
+      resolveQueue(key_queue_length_ - 1);
     return Key_NoKey;
   }
 
@@ -253,16 +690,19 @@ Key Qukeys::keyScanHook(Key mapped_key, byte row, byte col, uint8_t key_state) {
   if (keyToggledOff(key_state)) {
     // If the key isn't in the key_queue, proceed
     if (queue_index == QUKEY_NOT_FOUND) {
+      // A repeated quick tap keeps the window open for the next one
+      if (key_addr == quick_tap_addr_)
+        quick_tap_time_ = cycle_time_;
       // If a qukey was released while in its alternate state, change its keycode
-      if (isDualUse(mapped_key)) {
+      if (is_dual_use) {
         if (getQukeyState(key_addr) == QUKEY_STATE_ALTERNATE)
-          return getDualUseAlternateKey(mapped_key);
-        return getDualUsePrimaryKey(mapped_key);
+          return key_class.alternate;
+        return key_class.primary;
       } else if (qukey_index != QUKEY_NOT_FOUND) {
         if (getQukeyState(key_addr) == QUKEY_STATE_ALTERNATE)
-          return qukeys[qukey_index].alt_keycode;
-        return mapped_key;
+          return getQukey(qukey_index).alt_keycode;
       }
+      return mapped_key;
     }
     flushQueue(queue_index);
     return Key_NoKey;
@@ -272,7 +712,7 @@ Key Qukeys::keyScanHook(Key mapped_key, byte row, byte col, uint8_t key_state) {
 
   // If the key is not a qukey:
   if (qukey_index == QUKEY_NOT_FOUND &&
-      ! isDualUse(mapped_key)) {
+      !is_dual_use) {
     // If the key was pressed before the keys in the queue, proceed:
     if (queue_index == QUKEY_NOT_FOUND) {
       return mapped_key;
@@ -285,11 +725,11 @@ Key Qukeys::keyScanHook(Key mapped_key, byte row, byte col, uint8_t key_state) {
   // If the qukey is not in the queue, check its state
   if (queue_index == QUKEY_NOT_FOUND) {
     if (getQukeyState(key_addr) == QUKEY_STATE_ALTERNATE) {
-      if (isDualUse(mapped_key))
-        return getDualUseAlternateKey(mapped_key);
-      return qukeys[qukey_index].alt_keycode;
+      if (is_dual_use)
+        return key_class.alternate;
+      return getQukey(qukey_index).alt_keycode;
     } else { // qukey_state == QUKEY_STATE_PRIMARY
-      return getDualUsePrimaryKey(mapped_key);
+      return key_class.primary;
     }
   }
   // else state is undetermined; block. I could check timeouts here,
@@ -297,39 +737,193 @@ Key Qukeys::keyScanHook(Key mapped_key, byte row, byte col, uint8_t key_state) {
   return Key_NoKey;
 }
 
+void Qukeys::setAdaptiveTimeout(uint16_t min_time_limit, uint16_t max_time_limit) {
+  // The average has to fit in 16 bits of fixed point
+  if (max_time_limit > (0xFFFF >> QUKEYS_TAP_AVERAGE_SHIFT))
+    max_time_limit = 0xFFFF >> QUKEYS_TAP_AVERAGE_SHIFT;
+  adaptive_min_time_limit_ = min_time_limit;
+  adaptive_max_time_limit_ = max_time_limit;
+  // Start from the fixed timeout (the average is half of it)
+  tap_time_average_ = (time_limit_ / 2) << QUKEYS_TAP_AVERAGE_SHIFT;
+  scheduleTimeout();
+}
+
+// Update the moving average of tap durations. This is an exponentially
+// weighted average in fixed point, so it needs no history and no
+// division.
+void Qukeys::recordTap(uint16_t tap_time) {
+  if (adaptive_max_time_limit_ == 0)
+    return;
+  // Longer "taps" come from holds that ended before the timeout; they
+  // shouldn't drag the average past the top of the range
+  if (tap_time > adaptive_max_time_limit_)
+    tap_time = adaptive_max_time_limit_;
+  int32_t sample = (int32_t)tap_time << QUKEYS_TAP_AVERAGE_SHIFT;
+  tap_time_average_ += (sample - tap_time_average_) >> QUKEYS_TAP_WEIGHT_SHIFT;
+}
+
+// Get the global timeout, which is either fixed or adapted to the taps
+// recorded so far
+uint16_t Qukeys::getGlobalTimeout(void) {
+  if (adaptive_max_time_limit_ == 0)
+    return time_limit_;
+  uint16_t time_limit = tap_time_average_ >> (QUKEYS_TAP_AVERAGE_SHIFT - 1);
+  if (time_limit < adaptive_min_time_limit_)
+    return adaptive_min_time_limit_;
+  if (time_limit > adaptive_max_time_limit_)
+    return adaptive_max_time_limit_;
+  return time_limit;
+}
+
+// Get the time limit for a queued qukey (or DualUse key), falling back
+// to the global one if it doesn't have its own
+uint16_t Qukeys::getTimeout(const QueueItem &item) {
+  uint8_t timeout = 0;
+  if (item.qukey_index == QUKEY_DUAL_USE_MODIFIER) {
+    timeout = dual_use_modifier_timeout_;
+  } else if (item.qukey_index == QUKEY_DUAL_USE_LAYER) {
+    timeout = dual_use_layer_timeout_;
+  }
+#ifdef QUKEYS_PER_KEY_TIMEOUTS
+  else if (item.qukey_index >= 0) {
+    timeout = getQukeyTimeout(item.qukey_index);
+  }
+#endif
+  uint16_t time_limit = (timeout == 0) ? getGlobalTimeout() : timeout * QUKEY_TIMEOUT_UNIT;
+#ifdef QUKEYS_COMPACT_QUEUE
+  // In compact mode, the queue can't measure longer intervals
+  if (time_limit > QUKEYS_MAX_TIMEOUT)
+    return QUKEYS_MAX_TIMEOUT;
+#endif
+  return time_limit;
+}
+
+// Work out when the key at the head of the queue needs to be resolved.
+// A key that isn't a qukey is due right away (unless it might be part
+// of a combo); it's only still in the queue because the keys before it
+// were just flushed.
+void Qukeys::scheduleTimeout(void) {
+  timeout_pending_ = key_queue_length_ > 0;
+  if (!timeout_pending_)
+    return;
+  timeout_deadline_ = cycle_time_;
+  const QueueItem &head = queueItem(0);
+  uint16_t time_limit;
+  if (comboPending()) {
+    time_limit = combo_timeout_;
+  } else if (isQukey(head)) {
+    time_limit = getTimeout(head);
+  } else {
+    return;
+  }
+  // Dwell times are counted in queue time units, so the key is due at
+  // the start of the first unit in which it's past the limit
+  uint16_t dwell_time = queueDwellTime(head, queueTime());
+  if (dwell_time <= time_limit) {
+    timeout_deadline_ -= cycle_time_ % QUKEYS_QUEUE_TIME_UNIT;
+    timeout_deadline_ += ((time_limit - dwell_time) / QUKEYS_QUEUE_TIME_UNIT + 1) *
+                         QUKEYS_QUEUE_TIME_UNIT;
+  }
+}
+
 void Qukeys::preReportHook(void) {
+  QUKEYS_STATS_TIME_HOOK(pre_report_timing);
   // If the qukey has been held longer than the time limit, set its
   // state to the alternate keycode and add it to the report
-  uint16_t current_time = (uint16_t)millis();
+  queue_time_t current_time = queueTime();
   while (key_queue_length_ > 0) {
-    byte row = addr::row(key_queue_[0].addr);
-    byte col = addr::col(key_queue_[0].addr);
-    Key keycode = Layer.lookup(row, col);
-    bool is_dual_use = isDualUse(keycode);
-    if (lookupQukey(key_queue_[0].addr) != QUKEY_NOT_FOUND || is_dual_use) {
-      if ((current_time - key_queue_[0].start_time) > time_limit_) {
+    // Keys that might still be part of a combo have to wait
+    if (comboPending())
+      break;
+    QueueItem &head = queueItem(0);
+    if (isQukey(head)) {
+      if (queueDwellTime(head, current_time) > getTimeout(head)) {
+        if (!flushing_queue_)
+          beginFlush();
         flushKey(QUKEY_STATE_ALTERNATE, IS_PRESSED | WAS_PRESSED);
       } else {
         break;
       }
     } else {
+      if (!flushing_queue_)
+        beginFlush();
       flushKey(QUKEY_STATE_PRIMARY, IS_PRESSED | WAS_PRESSED);
     }
   }
+  if (flushing_queue_)
+    endFlush();
+  scheduleTimeout();
 }
 
 void Qukeys::loopHook(bool post_clear) {
-  if (!post_clear)
+  // Once the report for this cycle has been sent, read the clock for
+  // the next one
+  if (post_clear) {
+    QUKEYS_EVENT_LOG_DRAIN();
+    QUKEYS_STATS_END_CYCLE();
+#ifdef ARDUINO_VIRTUAL
+    checkInvariants();
+#endif
+    cycle_time_ = readClock();
+    return;
+  }
+  if (timeoutDue())
     return preReportHook();
 }
 
+#ifdef ARDUINO_VIRTUAL
+static bool checkInvariant(bool condition, const char *name) {
+  // Printed even without the trace, for the fuzzer
+  if (!condition)
+    printf("qukeys invariant %s\n", name);
+  return condition;
+}
+
+// Between cycles, every queued key must be marked in the queued keys
+// bitfield (and nothing else may be), and not also be held for a
+// combo. A harness feeding in random keystrokes can call this
+// after each event, too.
+bool Qukeys::checkInvariants(void) {
+  bool ok = checkInvariant(key_queue_length_ <= QUKEYS_QUEUE_MAX, "length");
+  ok &= checkInvariant(key_queue_head_ < QUKEYS_QUEUE_MAX, "head");
+  ok &= checkInvariant(!flushing_queue_, "flushing");
+  if (!ok)
+    return false;
+
+  uint8_t queued_count = 0;
+  for (uint8_t key_addr = 0; key_addr < TOTAL_KEYS; key_addr++) {
+    if (bitRead(queued_keys_[key_addr / 8], key_addr % 8))
+      queued_count++;
+  }
+  ok &= checkInvariant(queued_count == key_queue_length_, "queued");
+
+  for (uint8_t i = 0; i < key_queue_length_; i++) {
+    uint8_t key_addr = queueItem(i).addr;
+    if (!checkInvariant(key_addr < TOTAL_KEYS, "addr")) {
+      ok = false;
+      continue;
+    }
+    ok &= checkInvariant(bitRead(queued_keys_[key_addr / 8], key_addr % 8), "queued");
+    ok &= checkInvariant(!isComboHeld(key_addr), "combo");
+  }
+  return ok;
+}
+#endif
+
 void Qukeys::begin() {
   // initializing the key_queue seems unnecessary, actually
   for (int8_t i = 0; i < QUKEYS_QUEUE_MAX; i++) {
     key_queue_[i].addr = QUKEY_UNKNOWN_ADDR;
     key_queue_[i].start_time = 0;
+    key_queue_[i].qukey_index = QUKEY_NOT_FOUND;
+#ifndef QUKEYS_COMPACT_QUEUE
+    key_queue_[i].key = Key_NoKey;
+#endif
   }
+  key_queue_head_ = 0;
   key_queue_length_ = 0;
+  cycle_time_ = readClock();
+  indexQukeys();
 
   Kaleidoscope.useEventHandlerHook(keyScanHook);
   Kaleidoscope.useLoopHook(loopHook);
@@ -20,28 +20,144 @@
 
 #include <Kaleidoscope.h>
 #include <addr.h>
+#include <MultiReport/Keyboard.h>
+
+// Features that can be left out of the build to save flash, by defining
+// these when the library is compiled:
+//   QUKEYS_DISABLE_DUAL_USE        don't decode DualUse keys in the
+//                                  keymap (MT() and LT() go away)
+//   QUKEYS_DISABLE_LAYER_MATCHING  every qukey applies on every layer
+//   QUKEYS_DISABLE_ACTIVATION      no activate()/deactivate()/toggle();
+//                                  Qukeys is always on
+//   QUKEYS_DISABLE_TRACE           no debug output on the virtual hardware
+// QUKEYS_MINIMAL turns on all of them. Statistics, the event log and
+// per-key timeouts are already left out unless they're asked for.
+#ifdef QUKEYS_MINIMAL
+#ifndef QUKEYS_DISABLE_DUAL_USE
+#define QUKEYS_DISABLE_DUAL_USE
+#endif
+#ifndef QUKEYS_DISABLE_LAYER_MATCHING
+#define QUKEYS_DISABLE_LAYER_MATCHING
+#endif
+#ifndef QUKEYS_DISABLE_ACTIVATION
+#define QUKEYS_DISABLE_ACTIVATION
+#endif
+#ifndef QUKEYS_DISABLE_TRACE
+#define QUKEYS_DISABLE_TRACE
+#endif
+#endif
+
+#ifndef QUKEYS_DISABLE_DUAL_USE
 #include <Kaleidoscope-Ranges.h>
+#endif
 
 // Maximum length of the pending queue
+#ifndef QUKEYS_QUEUE_MAX
 #define QUKEYS_QUEUE_MAX 8
+#endif
 // Total number of keys on the keyboard (assuming full grid)
-#define TOTAL_KEYS ROWS * COLS
+#define TOTAL_KEYS (ROWS * COLS)
+// Size of a bitfield with one bit per key
+#define QUKEYS_BITFIELD_SIZE ((TOTAL_KEYS) / 8 + ((TOTAL_KEYS) % 8 ? 1 : 0))
+
+// Queue positions are returned as int8_t, and addrs are single bytes
+// with 0xFF reserved (QUKEY_UNKNOWN_ADDR), so all of the queue and
+// keyswitch bookkeeping fits in single-byte indexes
+static_assert(QUKEYS_QUEUE_MAX > 0 && QUKEYS_QUEUE_MAX <= 127,
+              "QUKEYS_QUEUE_MAX must be between 1 and 127");
+static_assert(TOTAL_KEYS <= 255, "Qukeys only supports keyboards with up to 255 keys");
 
 // Boolean values for storing qukey state
 #define QUKEY_STATE_PRIMARY false
 #define QUKEY_STATE_ALTERNATE true
+// Returned by Qukeys.state() for a key that's still waiting in the queue
+#define QUKEY_STATE_PENDING 2
+
+// Resolution policies: when a key is pressed while a qukey is waiting
+// in the queue, the qukey can get its alternate keycode when that key
+// is released (the default), right away (only if the alternate keycode
+// is a layer shift), or right away (always). On a split keyboard, it
+// can also depend on which hand the key is on: right away if it's the
+// other hand, but never on release if it's the same hand (see below).
+#define QUKEYS_RESOLVE_ON_RELEASE 0
+#define QUKEYS_RESOLVE_LAYERS_ON_PRESS 1
+#define QUKEYS_RESOLVE_ON_PRESS 2
+#define QUKEYS_RESOLVE_BY_HAND 3
+
+// Columns from this one on belong to the right hand, for
+// QUKEYS_RESOLVE_BY_HAND
+#ifndef QUKEYS_HAND_SPLIT_COL
+#define QUKEYS_HAND_SPLIT_COL (COLS / 2)
+#endif
 
-// Initialization addr value for empty key_queue. This seems to be
-// unnecessary, because we rely on keeping track of the lenght of the
-// queue, anyway.
+// Overflow policies: when a key is pressed while the queue is full, the
+// key at the head of the queue is flushed as primary (the default) or
+// as alternate, or the new key skips the queue (unless it's a qukey,
+// in which case the head is flushed as primary)
+#define QUKEYS_OVERFLOW_FLUSH_PRIMARY 0
+#define QUKEYS_OVERFLOW_FLUSH_ALTERNATE 1
+#define QUKEYS_OVERFLOW_PASS_THROUGH 2
+
+// Addr value that doesn't match any keyswitch. Flushed key_queue entries
+// for keys that were released get it, so endFlush() doesn't add them
+// back to the report; it's also used for "no key" in quick_tap_addr_,
+// unused combo keys and unused EEPROM qukeys.
 #define QUKEY_UNKNOWN_ADDR 0xFF
 // Value to return when no match is found in Qukeys.dict. A successful
 // match returns an index in the array, so this must be negative. Also
 // used for failed search of the key_queue.
 #define QUKEY_NOT_FOUND -1
+// Values stored in a QueueItem's qukey_index for DualUse keys (which
+// take precedence over any qukey defined for the same keyswitch)
+#define QUKEY_DUAL_USE_MODIFIER -2
+#define QUKEY_DUAL_USE_LAYER -3
+// Value stored in a QueueItem's qukey_index for a quick tap re-press
+// of a qukey, which has already been resolved as primary, so it's
+// flushed like a plain key (and isn't looked up again on a layer change)
+#define QUKEY_QUICK_TAP -4
 // Wildcard value; this matches any layer
 #define QUKEY_ALL_LAYERS -1
+// A qukey's layer mask has one bit for each layer it's defined on, so
+// qukeys can only be limited to the first QUKEYS_MAX_LAYERS layers (8,
+// 16 or 32); a wider mask makes every entry in the table bigger. On any
+// layer beyond those, only qukeys with every bit set (QUKEY_ALL_LAYERS)
+// apply.
+#ifndef QUKEYS_MAX_LAYERS
+#define QUKEYS_MAX_LAYERS 8
+#endif
+static_assert(QUKEYS_MAX_LAYERS == 8 || QUKEYS_MAX_LAYERS == 16 || QUKEYS_MAX_LAYERS == 32,
+              "QUKEYS_MAX_LAYERS must be 8, 16 or 32");
+#define QUKEY_ALL_LAYERS_MASK ((kaleidoscope::qukey_layer_mask_t)~0UL)
+// Value in the qukey index table for a keyswitch with no qukeys
+#define QUKEY_NO_INDEX 0xFF
+// Flag in the qukey index table for a keyswitch that has more than one
+// qukey (on different layers); lookups for it have to scan the rest of
+// the qukeys array from the first entry
+#define QUKEY_INDEX_MULTIPLE 0x80
+// Qukey indices are stored in seven bits (and passed around as int8_t),
+// so only this many entries of the qukeys array are used
+#define QUKEYS_TABLE_MAX (QUKEY_INDEX_MULTIPLE - 1)
+// Timeouts for individual qukeys and DualUse keys are stored in a
+// single byte, in units of this many milliseconds. A value of zero
+// means "use the global timeout".
+#define QUKEY_TIMEOUT_UNIT 4
+
+// Queued keys' press times are stored in milliseconds, or if
+// QUKEYS_COMPACT_QUEUE is defined when the library is compiled, in a
+// single byte in units of QUKEY_TIMEOUT_UNIT. That byte wraps around
+// every 1024ms, and a key's dwell time has to be able to go past its
+// timeout before that, so in compact mode the longest possible timeout
+// (for combos, too) is 1016ms. Compact mode doesn't keep queued keys'
+// keycodes either; they're looked up in the keymap again when they're
+// flushed. Together, that takes a queue entry from six bytes to three.
+#ifdef QUKEYS_COMPACT_QUEUE
+#define QUKEYS_QUEUE_TIME_UNIT QUKEY_TIMEOUT_UNIT
+#define QUKEYS_MAX_TIMEOUT (0xFE * QUKEYS_QUEUE_TIME_UNIT)
+#else
+#define QUKEYS_QUEUE_TIME_UNIT 1
+#endif
 
+#ifndef QUKEYS_DISABLE_DUAL_USE
 #define MT(mod, key) (Key) { \
     .raw = kaleidoscope::ranges::DUM_FIRST + \
       (((Key_ ## mod).keyCode - Key_LeftControl.keyCode) << 8) + (Key_ ## key).keyCode }
@@ -51,37 +167,199 @@
 #define GUI_T(key) MT(LeftGui, key)
 
 #define LT(layer, key) (Key) { .raw = kaleidoscope::ranges::DUL_FIRST + (layer << 8) + (Key_ ## key).keyCode }
+#endif
 
 namespace kaleidoscope {
 
-// Data structure for an individual qukey
+// The adaptive timeout tracks a moving average of tap durations (in
+// 1/16ms, with each new tap weighted 1/8), and sets the timeout to
+// twice that average
+#define QUKEYS_TAP_AVERAGE_SHIFT 4
+#define QUKEYS_TAP_WEIGHT_SHIFT 3
+
+// Convert a timeout in milliseconds to its single-byte form
+constexpr uint8_t shortTimeout(uint16_t time_limit) {
+  return (time_limit / QUKEY_TIMEOUT_UNIT > 0xFF) ? 0xFF : time_limit / QUKEY_TIMEOUT_UNIT;
+}
+
+#if QUKEYS_MAX_LAYERS == 8
+typedef uint8_t qukey_layer_mask_t;
+#define pgm_read_layer_mask(addr) pgm_read_byte(addr)
+#elif QUKEYS_MAX_LAYERS == 16
+typedef uint16_t qukey_layer_mask_t;
+#define pgm_read_layer_mask(addr) pgm_read_word(addr)
+#else
+typedef uint32_t qukey_layer_mask_t;
+#define pgm_read_layer_mask(addr) pgm_read_dword(addr)
+#endif
+
+// The mask bit for one layer (none for layers past QUKEYS_MAX_LAYERS)
+constexpr qukey_layer_mask_t qukeyLayerBit(uint8_t layer) {
+  return (layer < QUKEYS_MAX_LAYERS) ? (qukey_layer_mask_t)((qukey_layer_mask_t)1 << layer) : 0;
+}
+
+// The layers a qukey is defined on. A single layer number (or
+// QUKEY_ALL_LAYERS) converts to this implicitly, and QUKEY_LAYERS()
+// makes one for a list of layers, so the same qukey doesn't need an
+// entry for each of them. Anything else is an error, rather than being
+// taken for a layer number (a mask like `(1 << 0) | (1 << 2)` would be
+// layer 5).
+struct QukeyLayers {
+  constexpr QukeyLayers(int layer)
+    : mask(layer == QUKEY_ALL_LAYERS ? QUKEY_ALL_LAYERS_MASK :
+           (layer < 0) ? 0 : qukeyLayerBit(layer)) {}
+  constexpr QukeyLayers(int8_t layer) : QukeyLayers((int)layer) {}
+  constexpr QukeyLayers(uint8_t layer) : QukeyLayers((int)layer) {}
+  template <typename T> QukeyLayers(T layer) = delete;
+
+  static constexpr QukeyLayers fromMask(qukey_layer_mask_t mask) {
+    return QukeyLayers(mask, true);
+  }
+
+  qukey_layer_mask_t mask;
+
+ private:
+  constexpr QukeyLayers(qukey_layer_mask_t mask, bool) : mask(mask) {}
+};
+
+constexpr qukey_layer_mask_t qukeyLayerMask(void) {
+  return 0;
+}
+template <typename... Layers>
+constexpr qukey_layer_mask_t qukeyLayerMask(uint8_t layer, Layers... layers) {
+  return qukeyLayerBit(layer) | qukeyLayerMask(layers...);
+}
+
+#define QUKEY_LAYERS(...) \
+  kaleidoscope::QukeyLayers::fromMask(kaleidoscope::qukeyLayerMask(__VA_ARGS__))
+
+// Data structure for an individual qukey. The constructor is constexpr
+// so that tables of qukeys can be stored in PROGMEM.
+//
+// Individual timeouts cost an extra byte per qukey, so they're only
+// available if QUKEYS_PER_KEY_TIMEOUTS is defined when the library is
+// compiled (e.g. in the build flags). With QUKEYS_DISABLE_LAYER_MATCHING,
+// the layers aren't stored at all, but the constructor still takes them,
+// so the same table works either way.
+#ifdef QUKEYS_DISABLE_LAYER_MATCHING
+#define QUKEY_LAYERS_PARAM QukeyLayers
+#define QUKEY_LAYERS_INIT
+#else
+#define QUKEY_LAYERS_PARAM QukeyLayers layers
+#define QUKEY_LAYERS_INIT layers(layers.mask),
+#endif
 struct Qukey {
  public:
   Qukey(void) {}
-  Qukey(int8_t layer, byte row, byte col, Key alt_keycode);
+#ifdef QUKEYS_PER_KEY_TIMEOUTS
+  constexpr Qukey(QUKEY_LAYERS_PARAM, byte row, byte col, Key alt_keycode, uint16_t time_limit = 0)
+    : QUKEY_LAYERS_INIT addr(addr::addr(row, col)), alt_keycode(alt_keycode),
+      timeout(shortTimeout(time_limit)) {}
+#else
+  constexpr Qukey(QUKEY_LAYERS_PARAM, byte row, byte col, Key alt_keycode)
+    : QUKEY_LAYERS_INIT addr(addr::addr(row, col)), alt_keycode(alt_keycode) {}
+#endif
 
-  int8_t layer;
+#ifndef QUKEYS_DISABLE_LAYER_MATCHING
+  qukey_layer_mask_t layers;
+#endif
   uint8_t addr;
   Key alt_keycode;
+#ifdef QUKEYS_PER_KEY_TIMEOUTS
+  uint8_t timeout;
+#endif
 };
+#undef QUKEY_LAYERS_PARAM
+#undef QUKEY_LAYERS_INIT
+
+// A combo has two to four keys, and only the first QUKEYS_COMBOS_MAX
+// combos in the table are used
+#define QUKEY_COMBO_MAX_KEYS 4
+#define QUKEYS_COMBOS_MAX 32
+
+// Get the addr of a combo key, or QUKEY_UNKNOWN_ADDR for an unused one
+constexpr uint8_t comboKeyAddr(byte row, byte col) {
+  return (row >= ROWS || col >= COLS) ? QUKEY_UNKNOWN_ADDR : addr::addr(row, col);
+}
+
+// Data structure for a combo: a keycode that is produced by pressing
+// a set of keys at (nearly) the same time. Like Qukey, the constructor
+// is constexpr.
+struct QukeyCombo {
+ public:
+  QukeyCombo(void) {}
+  constexpr QukeyCombo(Key keycode, byte row0, byte col0, byte row1, byte col1,
+                       byte row2 = 0xFF, byte col2 = 0xFF, byte row3 = 0xFF, byte col3 = 0xFF)
+    : keycode(keycode),
+      addrs{comboKeyAddr(row0, col0), comboKeyAddr(row1, col1),
+            comboKeyAddr(row2, col2), comboKeyAddr(row3, col3)} {}
+
+  Key keycode;
+  uint8_t addrs[QUKEY_COMBO_MAX_KEYS];
+};
+
+#ifdef QUKEYS_COMPACT_QUEUE
+typedef uint8_t queue_time_t;
+#else
+typedef uint16_t queue_time_t;
+#endif
+
+// Kinds of keycode, as decoded by classifyKeycode()
+#define QUKEY_KIND_PLAIN 0
+#define QUKEY_KIND_DUAL_USE_MODIFIER 1
+#define QUKEY_KIND_DUAL_USE_LAYER 2
+
+// A keycode decoded once per event, so the DualUse ranges don't need
+// to be checked again for each decision about it
+struct KeyClass {
+  uint8_t kind;
+  Key primary;    // the keycode itself, unless it's a DualUse key
+  Key alternate;  // only used for DualUse keys
+};
+
+// Get the kind of a keycode without decoding it. This is all the fast
+// path needs, so it's inline; ordinary keys never get decoded at all.
+#ifdef QUKEYS_DISABLE_DUAL_USE
+inline uint8_t keycodeKind(Key) {
+  return QUKEY_KIND_PLAIN;
+}
+#else
+inline uint8_t keycodeKind(Key k) {
+  if (k.raw < ranges::DU_FIRST || k.raw > ranges::DU_LAST)
+    return QUKEY_KIND_PLAIN;
+  if (k.raw <= ranges::DUM_LAST)
+    return QUKEY_KIND_DUAL_USE_MODIFIER;
+  return QUKEY_KIND_DUAL_USE_LAYER;
+}
+#endif
 
 // Data structure for an entry in the key_queue
 struct QueueItem {
-  uint8_t addr;        // keyswitch coordinates
-  uint16_t start_time; // time a queued key was pressed
+  uint8_t addr;            // keyswitch coordinates
+  queue_time_t start_time; // time a queued key was pressed
+  int8_t qukey_index;  // qukey index, QUKEY_DUAL_USE_*, QUKEY_QUICK_TAP or QUKEY_NOT_FOUND
+#ifndef QUKEYS_COMPACT_QUEUE
+  Key key;             // keycode the key was mapped to
+#endif
 };
 
+// Function called when a qukey (or DualUse key) is resolved, with its
+// keyswitch, the keycode it produced, its state, and how long (in
+// milliseconds) it waited in the queue
+typedef void (*QukeyResolveCallback)(byte row, byte col, Key keycode,
+                                     bool qukey_state, uint16_t dwell_time);
+
 // The plugin itself
 class Qukeys : public KaleidoscopePlugin {
-  // I could use a bitfield to get the state values, but then we'd
-  // have to check the key_queue (there are three states). Or use a
-  // second bitfield for the indeterminite state. Using a bitfield
-  // would enable storing the qukey list in PROGMEM, but I don't know
-  // if the added complexity is worth it.
+  // Qukey states are kept in a bitfield (qukey_state_), with a second
+  // one (queued_keys_) for the keys that are still in the key_queue,
+  // which haven't been resolved yet. Nothing is written to the qukey
+  // list, so it can be stored in PROGMEM (see QUKEYS_PROGMEM()).
  public:
   Qukeys(void);
 
   void begin(void) final;
+#ifndef QUKEYS_DISABLE_ACTIVATION
   static void activate(void) {
     active_ = true;
   }
@@ -91,22 +369,167 @@ class Qukeys : public KaleidoscopePlugin {
   static void toggle(void) {
     active_ = !active_;
   }
+#endif
+  static void setResolutionPolicy(uint8_t policy) {
+    resolution_policy_ = policy;
+  }
+  static void setOverflowPolicy(uint8_t policy) {
+    overflow_policy_ = policy;
+  }
+  // Number of keypresses that found the queue full
+  static uint16_t overflowCount(void) {
+    return overflow_count_;
+  }
+  static void resetOverflowCount(void) {
+    overflow_count_ = 0;
+  }
   static void setTimeout(uint16_t time_limit) {
     time_limit_ = time_limit;
+    scheduleTimeout();
+  }
+  // Adapt the global timeout to the user's typing, within these limits
+  // (in milliseconds). A maximum of zero turns it off again.
+  static void setAdaptiveTimeout(uint16_t min_time_limit, uint16_t max_time_limit);
+  // Timeouts for DualUse keys in the keymap, which override the global
+  // timeout (zero restores it)
+  static void setDualUseModifierTimeout(uint16_t time_limit) {
+    dual_use_modifier_timeout_ = shortTimeout(time_limit);
+    scheduleTimeout();
+  }
+  static void setDualUseLayerTimeout(uint16_t time_limit) {
+    dual_use_layer_timeout_ = shortTimeout(time_limit);
+    scheduleTimeout();
+  }
+
+  // If a qukey is pressed again within this time (in milliseconds) of
+  // being tapped, it gets its primary keycode right away, so it can
+  // auto-repeat. Zero (the default) turns this off.
+  static void setQuickTapTimeout(uint16_t time_limit) {
+    quick_tap_timeout_ = time_limit;
+  }
+  // Time (in milliseconds) within which all the keys of a combo must be
+  // pressed
+  static void setComboTimeout(uint16_t time_limit) {
+#ifdef QUKEYS_COMPACT_QUEUE
+    if (time_limit > QUKEYS_MAX_TIMEOUT)
+      time_limit = QUKEYS_MAX_TIMEOUT;
+#endif
+    combo_timeout_ = time_limit;
+    scheduleTimeout();
   }
 
+  // The state of a keyswitch: QUKEY_STATE_PENDING if it's in the queue,
+  // otherwise QUKEY_STATE_ALTERNATE if it's a qukey that was last
+  // resolved to its alternate keycode, or QUKEY_STATE_PRIMARY
+  static uint8_t state(byte row, byte col) {
+    uint8_t key_addr = addr::addr(row, col);
+    if (bitRead(queued_keys_[key_addr / 8], key_addr % 8))
+      return QUKEY_STATE_PENDING;
+    return getQukeyState(key_addr);
+  }
+  static void setResolveCallback(QukeyResolveCallback callback) {
+    resolve_callback_ = callback;
+  }
+
+#ifdef ARDUINO_VIRTUAL
+  // Replace millis() as the clock source (NULL restores it), so a test
+  // harness can replay keystrokes with exactly the same timing
+  static void setClock(uint32_t (*clock)(void)) {
+    clock_ = clock;
+  }
+  // Check that the queue's bookkeeping is consistent (this is also done
+  // at the end of every cycle; see the trace in Qukeys.cpp)
+  static bool checkInvariants(void);
+#endif
+
   static Qukey * qukeys;
   static uint8_t qukeys_count;
+  // True if `qukeys` points to a table in PROGMEM (see QUKEYS_PROGMEM())
+  static bool qukeys_in_progmem;
+  static QukeyCombo * combos;
+  static uint8_t combos_count;
+  // Rebuild the addr index; this must be called after `qukeys`,
+  // `qukeys_count`, `combos` or `combos_count` is changed (the QUKEYS()
+  // and QUKEY_COMBOS() macros do it). It's safe while keys are queued;
+  // they're looked up again.
+  static void indexQukeys(void);
 
  private:
+  // The time (in milliseconds) the current scan cycle started. The
+  // clock is read once per cycle, so keys pressed in the same scan get
+  // the same timestamp.
+  static uint32_t cycle_time_;
+#ifdef ARDUINO_VIRTUAL
+  static uint32_t (*clock_)(void);
+  static uint32_t readClock(void) {
+    return (clock_ != NULL) ? (*clock_)() : millis();
+  }
+#else
+  static uint32_t readClock(void) {
+    return millis();
+  }
+#endif
+#ifndef QUKEYS_DISABLE_ACTIVATION
   static bool active_;
+#endif
+  static uint8_t resolution_policy_;
+  static uint8_t overflow_policy_;
+  static uint16_t overflow_count_;
   static uint16_t time_limit_;
+  static uint16_t adaptive_min_time_limit_;
+  static uint16_t adaptive_max_time_limit_;
+  static uint16_t tap_time_average_;
+  static void recordTap(uint16_t tap_time);
+  static uint16_t getGlobalTimeout(void);
+  static uint8_t dual_use_modifier_timeout_;
+  static uint8_t dual_use_layer_timeout_;
+  static uint16_t getTimeout(const QueueItem &item);
+  // The last qukey that was tapped, and when it was released
+  static uint16_t quick_tap_timeout_;
+  static uint8_t quick_tap_addr_;
+  static uint16_t quick_tap_time_;
+  static bool isQuickTap(uint8_t key_addr) {
+    return (key_addr == quick_tap_addr_ &&
+            (uint16_t)((uint16_t)cycle_time_ - quick_tap_time_) <= quick_tap_timeout_);
+  }
+  // Only the head of the queue can time out, so its deadline (in
+  // milliseconds) is all the loop hook needs to check
+  static bool timeout_pending_;
+  static uint32_t timeout_deadline_;
+  static void scheduleTimeout(void);
+  static bool timeoutDue(void) {
+    return timeout_pending_ && (int32_t)(cycle_time_ - timeout_deadline_) >= 0;
+  }
   static QueueItem key_queue_[QUKEYS_QUEUE_MAX];
+  static uint8_t key_queue_head_;
   static uint8_t key_queue_length_;
+  // The key_queue is a circular buffer starting at key_queue_head_, so
+  // queueItem(0) is always the first key that gets processed
+  static QueueItem & queueItem(uint8_t queue_index) {
+    uint8_t i = key_queue_head_ + queue_index;
+    if (i >= QUKEYS_QUEUE_MAX)
+      i -= QUKEYS_QUEUE_MAX;
+    return key_queue_[i];
+  }
+  // Does a queued key still have to be resolved?
+  static bool isQukey(const QueueItem &item) {
+    return item.qukey_index != QUKEY_NOT_FOUND && item.qukey_index != QUKEY_QUICK_TAP;
+  }
   static bool flushing_queue_;
+  // Position (in key_queue_) and number of the keys flushed since
+  // beginFlush() was called
+  static uint8_t flush_start_;
+  static uint8_t flush_count_;
+  // The (partial) current report, set aside while flushing. It's kept
+  // here rather than on the stack, because flushes happen deep inside
+  // the key scan's call chain.
+  static HID_KeyboardReport_Data_t saved_report_;
 
   // Qukey state bitfield
-  static uint8_t qukey_state_[(TOTAL_KEYS) / 8 + ((TOTAL_KEYS) % 8 ? 1 : 0)];
+  static uint8_t qukey_state_[QUKEYS_BITFIELD_SIZE];
+  // Keys that are in the queue
+  static uint8_t queued_keys_[QUKEYS_BITFIELD_SIZE];
+  static QukeyResolveCallback resolve_callback_;
   static bool getQukeyState(uint8_t addr) {
     return bitRead(qukey_state_[addr / 8], addr % 8);
   }
@@ -114,11 +537,87 @@ class Qukeys : public KaleidoscopePlugin {
     bitWrite(qukey_state_[addr / 8], addr % 8, qukey_state);
   }
 
+  // Combos: which keys belong to any combo, which keys are held after
+  // completing one, and which combos are currently held
+  static uint16_t combo_timeout_;
+  static uint8_t combo_keys_[QUKEYS_BITFIELD_SIZE];
+  static uint8_t combo_held_[QUKEYS_BITFIELD_SIZE];
+  static uint32_t active_combos_;
+  static bool isComboKey(uint8_t addr) {
+    return bitRead(combo_keys_[addr / 8], addr % 8);
+  }
+  static bool isComboHeld(uint8_t addr) {
+    return bitRead(combo_held_[addr / 8], addr % 8);
+  }
+  static bool comboHasKey(uint8_t combo_index, uint8_t key_addr);
+  static bool comboPending(void);
+  static int8_t completeCombo(uint8_t key_addr);
+  static Key comboKeyScan(uint8_t key_addr, uint8_t key_state);
+
+  // Index of the first qukey for each keyswitch addr, so lookups don't
+  // have to scan the whole qukeys array
+  static uint8_t qukey_index_[TOTAL_KEYS];
+  // Read a qukey entry from the table, wherever it's stored
+  static Qukey getQukey(int8_t qukey_index) {
+    if (!qukeys_in_progmem)
+      return qukeys[qukey_index];
+    Qukey qukey;
+    memcpy_P(&qukey, &qukeys[qukey_index], sizeof(qukey));
+    return qukey;
+  }
+  static uint8_t getQukeyAddr(int8_t qukey_index) {
+    if (!qukeys_in_progmem)
+      return qukeys[qukey_index].addr;
+    return pgm_read_byte(&qukeys[qukey_index].addr);
+  }
+#ifdef QUKEYS_PER_KEY_TIMEOUTS
+  static uint8_t getQukeyTimeout(int8_t qukey_index) {
+    if (!qukeys_in_progmem)
+      return qukeys[qukey_index].timeout;
+    return pgm_read_byte(&qukeys[qukey_index].timeout);
+  }
+#endif
+  // `layer_bit` is qukeyLayerBit() of the keyswitch's active layer
+#ifdef QUKEYS_DISABLE_LAYER_MATCHING
+  static bool qukeyMatchesLayer(int8_t, qukey_layer_mask_t) {
+    return true;
+  }
+#else
+  static bool qukeyMatchesLayer(int8_t qukey_index, qukey_layer_mask_t layer_bit) {
+    qukey_layer_mask_t layers = qukeys_in_progmem ?
+                                pgm_read_layer_mask(&qukeys[qukey_index].layers) :
+                                qukeys[qukey_index].layers;
+    return (layers & layer_bit) != 0 || layers == QUKEY_ALL_LAYERS_MASK;
+  }
+#endif
+  static bool hasQukey(uint8_t key_addr) {
+    return qukey_index_[key_addr] != QUKEY_NO_INDEX;
+  }
   static int8_t lookupQukey(uint8_t key_addr);
-  static void enqueue(uint8_t key_addr);
+  static void classifyKey(QueueItem &item, Key keycode, uint8_t kind, int8_t qukey_index);
+  static void reclassifyQueue(void);
+  static void enqueue(uint8_t key_addr, Key mapped_key, uint8_t kind, int8_t qukey_index);
   static int8_t searchQueue(uint8_t key_addr);
+  static queue_time_t queueTime(void) {
+    return (queue_time_t)(cycle_time_ / QUKEYS_QUEUE_TIME_UNIT);
+  }
+  // Time (in milliseconds) a queued key has been waiting. The cast makes
+  // the subtraction wrap around the same way the timestamps do.
+  static uint16_t queueDwellTime(const QueueItem &item, queue_time_t current_time) {
+    return (queue_time_t)(current_time - item.start_time) * QUKEYS_QUEUE_TIME_UNIT;
+  }
+  static Key flushedKeycode(const QueueItem &item);
+  static bool reportHasKey(Key keycode);
+  static void beginFlush(void);
+  static void endFlush(void);
   static void flushKey(bool qukey_state, uint8_t keyswitch_state);
   static void flushQueue(int8_t index);
+  static bool hasLayerAlternate(const QueueItem &item);
+  static bool isRightHand(uint8_t key_addr) {
+    return addr::col(key_addr) >= QUKEYS_HAND_SPLIT_COL;
+  }
+  static bool resolvesOnPress(void);
+  static void resolveQueue(uint8_t count);
   static void flushQueue(void);
 
   static Key keyScanHook(Key mapped_key, byte row, byte col, uint8_t key_state);
@@ -136,4 +635,23 @@ extern kaleidoscope::Qukeys Qukeys;
   static kaleidoscope::Qukey qk_table[] = { qukey_defs };		\
   Qukeys.qukeys = qk_table;						\
   Qukeys.qukeys_count = sizeof(qk_table) / sizeof(kaleidoscope::Qukey); \
+  Qukeys.qukeys_in_progmem = false;					\
+  Qukeys.indexQukeys();							\
+}
+
+// Same as QUKEYS(), but the table is stored in PROGMEM instead of RAM
+#define QUKEYS_PROGMEM(qukey_defs...) {					\
+  static const kaleidoscope::Qukey qk_table[] PROGMEM = { qukey_defs }; \
+  Qukeys.qukeys = const_cast<kaleidoscope::Qukey *>(qk_table);		\
+  Qukeys.qukeys_count = sizeof(qk_table) / sizeof(kaleidoscope::Qukey); \
+  Qukeys.qukeys_in_progmem = true;					\
+  Qukeys.indexQukeys();							\
+}
+
+// macro for use in sketch file to define combos
+#define QUKEY_COMBOS(combo_defs...) {					\
+  static kaleidoscope::QukeyCombo combo_table[] = { combo_defs };	\
+  Qukeys.combos = combo_table;						\
+  Qukeys.combos_count = sizeof(combo_table) / sizeof(kaleidoscope::QukeyCombo); \
+  Qukeys.indexQukeys();							\
 }
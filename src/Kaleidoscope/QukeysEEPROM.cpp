@@ -0,0 +1,141 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Kaleidoscope-Qukeys.h>
+
+#ifdef QUKEYS_ENABLE_EEPROM
+
+#include <Kaleidoscope/QukeysEEPROM.h>
+
+namespace kaleidoscope {
+
+uint16_t EEPROMQukeys::eeprom_base_;
+Qukey EEPROMQukeys::qukeys_[];
+
+void EEPROMQukeys::begin(void) {
+  eeprom_base_ = ::EEPROMSettings.requestSlice(QUKEYS_EEPROM_MAX * sizeof(Record));
+
+  for (uint8_t i = 0; i < QUKEYS_EEPROM_MAX; i++) {
+    Record record;
+    EEPROM.get(eeprom_base_ + i * sizeof(Record), record);
+    loadQukey(i, record);
+  }
+
+  ::Qukeys.qukeys = qukeys_;
+  ::Qukeys.qukeys_count = QUKEYS_EEPROM_MAX;
+  ::Qukeys.qukeys_in_progmem = false;
+  ::Qukeys.indexQukeys();
+}
+
+// Convert a stored entry to the qukey in the RAM table. Layers beyond
+// the first QUKEYS_MAX_LAYERS are dropped from the mask (unless it has
+// all of them).
+void EEPROMQukeys::loadQukey(uint8_t index, const Record &record) {
+  Qukey &qukey = qukeys_[index];
+  if (record.row >= ROWS || record.col >= COLS) {
+    // Unused entries (including never-written EEPROM, which reads as
+    // 0xFF) get an addr that doesn't match any keyswitch, so
+    // indexQukeys() skips them
+#ifndef QUKEYS_DISABLE_LAYER_MATCHING
+    qukey.layers = 0;
+#endif
+    qukey.addr = QUKEY_UNKNOWN_ADDR;
+    qukey.alt_keycode = Key_NoKey;
+    return;
+  }
+  qukey_layer_mask_t layers = (record.layers == 0xFFFFFFFF) ?
+                              QUKEY_ALL_LAYERS_MASK : (qukey_layer_mask_t)record.layers;
+  Key alt_keycode;
+  alt_keycode.raw = record.keycode;
+  qukey = Qukey(QukeyLayers::fromMask(layers), record.row, record.col, alt_keycode);
+}
+
+void EEPROMQukeys::updateQukey(uint8_t index, uint32_t layers, uint8_t row, uint8_t col,
+                               Key alt_keycode) {
+  Record record;
+  if (row >= ROWS || col >= COLS) {
+    // Clear the entry
+    record.layers = 0;
+    record.row = 0xFF;
+    record.col = 0xFF;
+    record.keycode = Key_NoKey.raw;
+  } else {
+    record.layers = layers;
+    record.row = row;
+    record.col = col;
+    record.keycode = alt_keycode.raw;
+  }
+  EEPROM.put(eeprom_base_ + index * sizeof(Record), record);
+  loadQukey(index, record);
+}
+
+// qukeys.map prints each entry as four numbers: layer mask (-1 for all
+// layers, and always -1 without layer matching), row, col and the
+// alternate keycode (unused entries have row and col 255). Given the
+// same list of numbers, it stores them, starting with the first entry.
+bool EEPROMQukeys::focusHook(const char *command) {
+  if (strcmp_P(command, PSTR("qukeys.map")) != 0)
+    return false;
+
+  if (Serial.peek() == '\n') {
+    for (uint8_t i = 0; i < QUKEYS_EEPROM_MAX; i++) {
+      const Qukey &qukey = qukeys_[i];
+      bool used = qukey.addr < TOTAL_KEYS;
+#ifdef QUKEYS_DISABLE_LAYER_MATCHING
+      Serial.print(QUKEY_ALL_LAYERS);
+#else
+      if (qukey.layers == QUKEY_ALL_LAYERS_MASK) {
+        Serial.print(QUKEY_ALL_LAYERS);
+      } else {
+        Serial.print((unsigned long)qukey.layers);
+      }
+#endif
+      Serial.print(" ");
+      Serial.print(used ? addr::row(qukey.addr) : 0xFF);
+      Serial.print(" ");
+      Serial.print(used ? addr::col(qukey.addr) : 0xFF);
+      Serial.print(" ");
+      Serial.print(qukey.alt_keycode.raw);
+      Serial.print(" ");
+    }
+    Serial.println();
+    return true;
+  }
+
+  uint8_t i = 0;
+  while (Serial.peek() != '\n' && i < QUKEYS_EEPROM_MAX) {
+    long layers = Serial.parseInt();
+    uint8_t row = Serial.parseInt();
+    uint8_t col = Serial.parseInt();
+    Key alt_keycode;
+    alt_keycode.raw = Serial.parseInt();
+    // -1 (all layers) becomes a mask with every bit set
+    updateQukey(i, (uint32_t)layers, row, col, alt_keycode);
+    i++;
+  }
+  // Only rebuild the index once, after all the changes (this also looks
+  // up any keys that are still in the queue again)
+  ::Qukeys.indexQukeys();
+  return true;
+}
+
+} // namespace kaleidoscope {
+
+kaleidoscope::EEPROMQukeys EEPROMQukeys;
+
+#endif
@@ -0,0 +1,83 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// Like the other optional modules, this is only compiled in if
+// QUKEYS_ENABLE_EEPROM is defined when the library is compiled, so
+// sketches that don't use it don't need Kaleidoscope-EEPROM-Settings.
+#ifndef QUKEYS_ENABLE_EEPROM
+#error "Define QUKEYS_ENABLE_EEPROM in the build flags to use Kaleidoscope/QukeysEEPROM.h"
+#else
+
+#include <Kaleidoscope.h>
+#include <Kaleidoscope/Qukeys.h>
+#include <Kaleidoscope-EEPROM-Settings.h>
+#include <Kaleidoscope-Focus.h>
+
+// Number of qukeys that can be stored in EEPROM. They're loaded into a
+// table of this size in RAM, so it's a compile-time limit.
+#ifndef QUKEYS_EEPROM_MAX
+#define QUKEYS_EEPROM_MAX 16
+#endif
+static_assert(QUKEYS_EEPROM_MAX <= QUKEYS_TABLE_MAX,
+              "QUKEYS_EEPROM_MAX must be at most 127 (the size of the qukey index)");
+
+namespace kaleidoscope {
+
+// Stores the qukey table in EEPROM, so it can be changed (through
+// Focus) without flashing new firmware. The table is copied into RAM
+// when it's loaded, and whenever an entry is changed, so Qukeys never
+// reads EEPROM while it's processing keys.
+class EEPROMQukeys : public KaleidoscopePlugin {
+ public:
+  EEPROMQukeys(void) {}
+
+  // Reserves EEPROM space for the table, loads it, and makes it the
+  // table Qukeys uses
+  void begin(void) final;
+
+  static bool focusHook(const char *command);
+
+ private:
+  // An entry the way it's stored in EEPROM. Unlike Qukey, its layout
+  // doesn't depend on the build options, so a stored table still reads
+  // the same after the firmware is built with different ones.
+  struct Record {
+    uint32_t layers;   // layer mask, with every bit set for all layers
+    uint8_t row;       // 0xFF (or out of range) for an unused entry
+    uint8_t col;
+    uint16_t keycode;  // the alternate keycode's raw value
+  };
+  static_assert(sizeof(Record) == 8, "EEPROMQukeys::Record must not be padded");
+
+  static uint16_t eeprom_base_;
+  static Qukey qukeys_[QUKEYS_EEPROM_MAX];
+
+  static void loadQukey(uint8_t index, const Record &record);
+  static void updateQukey(uint8_t index, uint32_t layers, uint8_t row, uint8_t col,
+                          Key alt_keycode);
+};
+
+} // namespace kaleidoscope {
+
+extern kaleidoscope::EEPROMQukeys EEPROMQukeys;
+
+#define FOCUS_HOOK_EEPROM_QUKEYS FOCUS_HOOK(EEPROMQukeys.focusHook, "qukeys.map")
+
+#endif
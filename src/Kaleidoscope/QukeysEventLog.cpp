@@ -0,0 +1,78 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Kaleidoscope-Qukeys.h>
+
+#ifdef QUKEYS_ENABLE_EVENT_LOG
+
+namespace kaleidoscope {
+
+bool QukeysEventLog::enabled = false;
+uint8_t QukeysEventLog::buffer_[][QUKEYS_EVENT_RECORD_SIZE] = {};
+uint8_t QukeysEventLog::head_ = 0;
+uint8_t QukeysEventLog::length_ = 0;
+uint16_t QukeysEventLog::dropped_ = 0;
+
+void QukeysEventLog::record(uint8_t event, uint8_t key_addr, uint8_t state, uint16_t time) {
+  if (!enabled)
+    return;
+  if (length_ == QUKEYS_EVENT_LOG_SIZE) {
+    dropped_++;
+    return;
+  }
+  uint8_t *entry = buffer_[(head_ + length_) & (QUKEYS_EVENT_LOG_SIZE - 1)];
+  entry[0] = 0xA0 | (state << 2) | event;
+  entry[1] = key_addr;
+  entry[2] = time & 0xFF;
+  entry[3] = time >> 8;
+  length_++;
+}
+
+// Send as many complete records as the serial port will take without
+// blocking
+void QukeysEventLog::drain(void) {
+  if (!enabled)
+    return;
+  // Report dropped records once there's room to say so
+  if (dropped_ != 0 && length_ < QUKEYS_EVENT_LOG_SIZE) {
+    uint16_t dropped = dropped_;
+    dropped_ = 0;
+    record(QUKEYS_EVENT_DROPPED, 0, 0, dropped);
+  }
+  while (length_ > 0 && Serial.availableForWrite() >= QUKEYS_EVENT_RECORD_SIZE) {
+    Serial.write(buffer_[head_], QUKEYS_EVENT_RECORD_SIZE);
+    head_ = (head_ + 1) & (QUKEYS_EVENT_LOG_SIZE - 1);
+    length_--;
+  }
+}
+
+// `qukeys.log 1` starts sending records, and `qukeys.log 0` stops
+bool QukeysEventLog::focusHook(const char *command) {
+  if (strcmp_P(command, PSTR("qukeys.log")) != 0)
+    return false;
+
+  enabled = (Serial.parseInt() != 0);
+  head_ = 0;
+  length_ = 0;
+  dropped_ = 0;
+  return true;
+}
+
+} // namespace kaleidoscope {
+
+#endif
@@ -0,0 +1,92 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <Kaleidoscope.h>
+
+// A log of the keys Qukeys handles, streamed over the serial port for
+// analysis on the host (see extras/qukeys_event_log.py). It's only
+// compiled in if QUKEYS_ENABLE_EVENT_LOG is defined when the library is
+// compiled; otherwise the QUKEYS_EVENT_LOG* macros below expand to
+// nothing. Even then, nothing is sent until it's turned on through
+// Focus (`qukeys.log 1`).
+//
+// Each record is four bytes:
+//   0: 0xA0 | (state << 2) | event
+//   1: keyswitch addr
+//   2, 3: time in milliseconds (16 bits, little-endian)
+// where <state> is 0 (not a qukey), 1 (primary) or 2 (alternate), and
+// only means something for resolve events. A "dropped" event's time is
+// the number of records that didn't fit in the buffer instead.
+
+#ifdef QUKEYS_ENABLE_EVENT_LOG
+
+#include <Kaleidoscope-Focus.h>
+
+#define QUKEYS_EVENT_PRESS 0
+#define QUKEYS_EVENT_RELEASE 1
+#define QUKEYS_EVENT_RESOLVE 2
+#define QUKEYS_EVENT_DROPPED 3
+
+#define QUKEYS_EVENT_RECORD_SIZE 4
+
+// Number of records the buffer holds; this must be a power of two
+#ifndef QUKEYS_EVENT_LOG_SIZE
+#define QUKEYS_EVENT_LOG_SIZE 16
+#endif
+static_assert((QUKEYS_EVENT_LOG_SIZE & (QUKEYS_EVENT_LOG_SIZE - 1)) == 0 &&
+              QUKEYS_EVENT_LOG_SIZE <= 128,
+              "QUKEYS_EVENT_LOG_SIZE must be a power of two, up to 128");
+
+namespace kaleidoscope {
+
+// Records are added during the key scan and sent from the loop hook,
+// only as far as the serial port has room for them, so logging never
+// waits for the host. If the buffer fills up, records are dropped (and
+// counted) rather than overwriting ones that haven't been sent.
+class QukeysEventLog {
+ public:
+  static bool enabled;
+
+  static void record(uint8_t event, uint8_t key_addr, uint8_t state, uint16_t time);
+  static void drain(void);
+  static bool focusHook(const char *command);
+
+ private:
+  static uint8_t buffer_[QUKEYS_EVENT_LOG_SIZE][QUKEYS_EVENT_RECORD_SIZE];
+  static uint8_t head_;
+  static uint8_t length_;
+  static uint16_t dropped_;
+};
+
+} // namespace kaleidoscope {
+
+#define QUKEYS_EVENT_LOG(event, key_addr, state, time)			\
+  kaleidoscope::QukeysEventLog::record(QUKEYS_EVENT_ ## event, key_addr, state, time)
+#define QUKEYS_EVENT_LOG_DRAIN() kaleidoscope::QukeysEventLog::drain()
+
+#define FOCUS_HOOK_QUKEYS_EVENT_LOG FOCUS_HOOK(kaleidoscope::QukeysEventLog::focusHook, \
+                                               "qukeys.log")
+
+#else // ifdef QUKEYS_ENABLE_EVENT_LOG
+
+#define QUKEYS_EVENT_LOG(event, key_addr, state, time)
+#define QUKEYS_EVENT_LOG_DRAIN()
+
+#endif
@@ -0,0 +1,111 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Kaleidoscope-Qukeys.h>
+
+#ifdef QUKEYS_ENABLE_STATS
+
+namespace kaleidoscope {
+
+void QukeysHookTiming::record(uint16_t elapsed) {
+  if (count == 0 || elapsed < min)
+    min = elapsed;
+  if (elapsed > max)
+    max = elapsed;
+  total += elapsed;
+  count++;
+}
+
+void QukeysHookTiming::endCycle(void) {
+  if (cycle_called)
+    record(cycle_total);
+  cycle_total = 0;
+  cycle_called = false;
+}
+
+void QukeysHookTiming::reset(void) {
+  min = 0;
+  max = 0;
+  total = 0;
+  count = 0;
+  cycle_total = 0;
+  cycle_called = false;
+}
+
+QukeysHookTiming QukeysStats::scan_timing;
+QukeysHookTiming QukeysStats::pre_report_timing;
+uint16_t QukeysStats::dwell_histogram[] = {};
+uint16_t QukeysStats::primary_count;
+uint16_t QukeysStats::alternate_count;
+
+void QukeysStats::recordDwell(uint16_t dwell_time) {
+  uint16_t bucket = dwell_time / QUKEYS_DWELL_BUCKET_WIDTH;
+  if (bucket >= QUKEYS_DWELL_BUCKETS)
+    bucket = QUKEYS_DWELL_BUCKETS - 1;
+  dwell_histogram[bucket]++;
+}
+
+void QukeysStats::reset(void) {
+  scan_timing.reset();
+  pre_report_timing.reset();
+  for (uint8_t i = 0; i < QUKEYS_DWELL_BUCKETS; i++)
+    dwell_histogram[i] = 0;
+  primary_count = 0;
+  alternate_count = 0;
+  Qukeys::resetOverflowCount();
+}
+
+static void printTiming(const QukeysHookTiming &timing) {
+  Serial.print(timing.min);
+  Serial.print(" ");
+  Serial.print(timing.max);
+  Serial.print(" ");
+  Serial.println(timing.count ? timing.total / timing.count : 0);
+}
+
+// qukeys.stats prints (one per line): keyScanHook() min/max/mean time
+// and preReportHook() min/max/mean time in microseconds per scan cycle
+// (for the cycles in which they ran), the dwell time
+// histogram, and the primary, alternate and overflow counts (the last
+// one is kept by Qukeys itself)
+bool QukeysStats::focusHook(const char *command) {
+  if (strcmp_P(command, PSTR("qukeys.stats.reset")) == 0) {
+    reset();
+    return true;
+  }
+  if (strcmp_P(command, PSTR("qukeys.stats")) != 0)
+    return false;
+
+  printTiming(scan_timing);
+  printTiming(pre_report_timing);
+  for (uint8_t i = 0; i < QUKEYS_DWELL_BUCKETS; i++) {
+    Serial.print(dwell_histogram[i]);
+    Serial.print(" ");
+  }
+  Serial.println();
+  Serial.print(primary_count);
+  Serial.print(" ");
+  Serial.print(alternate_count);
+  Serial.print(" ");
+  Serial.println(Qukeys::overflowCount());
+  return true;
+}
+
+} // namespace kaleidoscope {
+
+#endif
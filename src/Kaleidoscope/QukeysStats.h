@@ -0,0 +1,118 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <Kaleidoscope.h>
+
+// Performance statistics for Qukeys. These are only collected if
+// QUKEYS_ENABLE_STATS is defined when the library is compiled (e.g. in
+// the build flags); otherwise all of the QUKEYS_STATS_* macros below
+// expand to nothing.
+
+#ifdef QUKEYS_ENABLE_STATS
+
+#include <Kaleidoscope-Focus.h>
+
+// Number and width (in milliseconds) of the queue dwell time histogram
+// buckets. The last bucket also counts anything longer.
+#define QUKEYS_DWELL_BUCKETS 8
+#define QUKEYS_DWELL_BUCKET_WIDTH 32
+
+namespace kaleidoscope {
+
+// Time spent (in microseconds) in one of the Qukeys hooks, per scan
+// cycle. The calls in a cycle are added up, and the total recorded once
+// at the end of it. Each call is usually shorter than micros() can
+// resolve, but the rounding evens out over a cycle's worth of calls.
+struct QukeysHookTiming {
+  uint16_t min;
+  uint16_t max;
+  uint32_t total;
+  uint32_t count;
+  uint16_t cycle_total;
+  bool cycle_called;
+
+  void add(uint16_t elapsed) {
+    cycle_total += elapsed;
+    cycle_called = true;
+  }
+  void endCycle(void);
+  void record(uint16_t elapsed);
+  void reset(void);
+};
+
+class QukeysStats {
+ public:
+  static QukeysHookTiming scan_timing;
+  static QukeysHookTiming pre_report_timing;
+  // How long keys waited in the queue before they were flushed
+  static uint16_t dwell_histogram[QUKEYS_DWELL_BUCKETS];
+  // Number of keys flushed from the queue in each state
+  static uint16_t primary_count;
+  static uint16_t alternate_count;
+
+  static void recordDwell(uint16_t dwell_time);
+  static void endCycle(void) {
+    scan_timing.endCycle();
+    pre_report_timing.endCycle();
+  }
+  static void reset(void);
+  static bool focusHook(const char *command);
+};
+
+// Adds the time from its construction until it goes out of scope, so
+// it works no matter which way a hook returns. A disabled timer (for a
+// nested call that's already being timed) does nothing.
+class QukeysStatsTimer {
+ public:
+  explicit QukeysStatsTimer(QukeysHookTiming &timing, bool enabled = true)
+    : timing_(enabled ? &timing : NULL), start_time_(enabled ? micros() : 0) {}
+  ~QukeysStatsTimer() {
+    if (timing_ != NULL)
+      timing_->add((uint16_t)micros() - start_time_);
+  }
+
+ private:
+  QukeysHookTiming *timing_;
+  uint16_t start_time_;
+};
+
+} // namespace kaleidoscope {
+
+#define QUKEYS_STATS_TIME_HOOK(timing) \
+  kaleidoscope::QukeysStatsTimer qukeys_stats_timer(kaleidoscope::QukeysStats::timing)
+#define QUKEYS_STATS_TIME_OUTER_HOOK(timing, nested) \
+  kaleidoscope::QukeysStatsTimer qukeys_stats_timer(kaleidoscope::QukeysStats::timing, !(nested))
+#define QUKEYS_STATS_END_CYCLE() kaleidoscope::QukeysStats::endCycle()
+#define QUKEYS_STATS_COUNT(counter) kaleidoscope::QukeysStats::counter++
+#define QUKEYS_STATS_DWELL(dwell_time) kaleidoscope::QukeysStats::recordDwell(dwell_time)
+
+#define FOCUS_HOOK_QUKEYS_STATS FOCUS_HOOK(kaleidoscope::QukeysStats::focusHook, \
+                                           "qukeys.stats\n"                        \
+                                           "qukeys.stats.reset")
+
+#else // ifdef QUKEYS_ENABLE_STATS
+
+#define QUKEYS_STATS_TIME_HOOK(timing)
+#define QUKEYS_STATS_TIME_OUTER_HOOK(timing, nested)
+#define QUKEYS_STATS_END_CYCLE()
+#define QUKEYS_STATS_COUNT(counter)
+#define QUKEYS_STATS_DWELL(dwell_time)
+
+#endif
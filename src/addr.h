@@ -25,20 +25,30 @@
 // as the keyboard has fewer than 256 keys.
 namespace kaleidoscope {
 namespace addr {
+
+// AVR has no hardware divider, so row() avoids dividing by COLS. If
+// COLS is a power of two, it's a shift. Otherwise, it multiplies by
+// ceil(2^16 / COLS) and keeps the high bits, which gives exactly the
+// same result as division for any 8-bit addr and any COLS below 256.
+constexpr uint8_t log2(uint8_t n) {
+  return (n <= 1) ? 0 : 1 + log2(n >> 1);
+}
+constexpr bool cols_is_power_of_two = (COLS & (COLS - 1)) == 0;
+constexpr uint8_t cols_shift = log2(COLS);
+constexpr uint32_t row_multiplier = (0x10000UL + COLS - 1) / COLS;
+
 inline uint8_t row(uint8_t key_addr) {
-  return (key_addr / COLS);
+  if (cols_is_power_of_two)
+    return key_addr >> cols_shift;
+  return (key_addr * row_multiplier) >> 16;
 }
 inline uint8_t col(uint8_t key_addr) {
-  return (key_addr % COLS);
+  if (cols_is_power_of_two)
+    return key_addr & (COLS - 1);
+  return key_addr - (row(key_addr) * COLS);
 }
-inline uint8_t addr(uint8_t row, uint8_t col) {
+constexpr uint8_t addr(uint8_t row, uint8_t col) {
   return ((row * COLS) + col);
 }
-inline void mask(uint8_t key_addr) {
-  KeyboardHardware.maskKey(row(key_addr), col(key_addr));
-}
-inline void unmask(uint8_t key_addr) {
-  KeyboardHardware.unMaskKey(row(key_addr), col(key_addr));
-}
 } // namespace addr {
 } // namespace kaleidoscope {
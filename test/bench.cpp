@@ -0,0 +1,300 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Replays keystroke traces through Qukeys on the virtual keyboard, and
+// prints for each one: the number of key events, the number of HID
+// reports sent, how many qukeys were resolved differently than the
+// typist meant, and how long Qukeys took per event and per scan cycle.
+// The times are measured on the host, as the difference from replaying
+// the same trace with no plugin at all, so they're only good for
+// comparing builds on the same machine.
+//
+// Usage: bench [-p policy] [-t timeout] [-r repeats] [trace file...]
+//
+// Without trace files, it replays a set of synthetic ones. A trace file
+// has one event per line:
+//   <time in ms> <p|r> <row> <col> [tap|hold]
+// where "p" is a press and "r" a release, and a press can say what the
+// typist meant the key to do, if it's a qukey (extras/qukeys_event_log.py
+// --trace makes these from an event log, without the last field).
+
+#include <Kaleidoscope-Qukeys.h>
+#include "virtual_keyboard.h"
+
+#include <chrono>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+namespace vk = virtual_keyboard;
+
+#define INTENT_NONE -1
+#define INTENT_TAP QUKEY_STATE_PRIMARY
+#define INTENT_HOLD QUKEY_STATE_ALTERNATE
+
+struct TraceEvent {
+  uint32_t time;
+  byte row;
+  byte col;
+  bool pressed;
+  int8_t intent;
+};
+
+struct Trace {
+  std::string name;
+  std::vector<TraceEvent> events;
+};
+
+// Make the results the same everywhere, whatever rand() does
+static uint32_t random_state;
+static uint32_t randomNumber(uint32_t limit) {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state % limit;
+}
+
+// The keys used for typing: three rows of five on each hand, with
+// home-row modifiers (and their mirror images) on the middle row
+static const byte typing_rows[] = {1, 2, 3};
+static const byte typing_cols[] = {1, 2, 3, 4, 5, 10, 11, 12, 13, 14};
+#define TYPING_KEYS (sizeof(typing_rows) * sizeof(typing_cols))
+
+static bool isQukey(byte row, byte col) {
+  return row == 2 && ((col >= 1 && col <= 4) || (col >= 11 && col <= 14));
+}
+
+static void setupKeymap(void) {
+  uint8_t keycode = Key_A.keyCode;
+  for (byte row = 0; row < ROWS; row++) {
+    for (byte col = 0; col < COLS; col++) {
+      vk::setKey(0, row, col, KEY(keycode));
+      if (++keycode > Key_Slash.keyCode)
+        keycode = Key_A.keyCode;
+    }
+  }
+}
+
+static void setupQukeys(uint8_t policy, uint16_t timeout) {
+  Qukeys.begin();
+  QUKEYS(
+    kaleidoscope::Qukey(0, 2, 1, Key_LeftGui),
+    kaleidoscope::Qukey(0, 2, 2, Key_LeftAlt),
+    kaleidoscope::Qukey(0, 2, 3, Key_LeftControl),
+    kaleidoscope::Qukey(0, 2, 4, Key_LeftShift),
+    kaleidoscope::Qukey(0, 2, 11, Key_RightShift),
+    kaleidoscope::Qukey(0, 2, 12, Key_RightControl),
+    kaleidoscope::Qukey(0, 2, 13, Key_RightAlt),
+    kaleidoscope::Qukey(0, 2, 14, Key_RightGui)
+  )
+  Qukeys.setResolutionPolicy(policy);
+  Qukeys.setTimeout(timeout);
+}
+
+static void addKeystroke(Trace &trace, uint32_t press_time, uint32_t release_time,
+                         byte row, byte col, int8_t intent) {
+  TraceEvent press = {press_time, row, col, true, intent};
+  TraceEvent release = {release_time, row, col, false, INTENT_NONE};
+  trace.events.push_back(press);
+  trace.events.push_back(release);
+}
+
+// Typing at `wpm` words (of five keystrokes) per minute, with each key
+// held for 60-130ms, so at faster speeds consecutive keystrokes overlap.
+// If `chord_every` isn't zero, every so many keystrokes are typed with
+// the opposite hand's shift qukey held.
+static Trace syntheticTrace(const char *name, uint16_t wpm, uint16_t chord_every,
+                            uint16_t keystrokes) {
+  Trace trace;
+  trace.name = name;
+  random_state = 0x2545F491 ^ (wpm << 8) ^ chord_every;
+  uint32_t free_at[ROWS][COLS] = {};
+  uint32_t interval = 12000 / wpm;
+  uint32_t time = 0;
+  for (uint16_t n = 0; n < keystrokes; n++) {
+    byte row, col;
+    do {
+      uint32_t i = randomNumber(TYPING_KEYS);
+      row = typing_rows[i / sizeof(typing_cols)];
+      col = typing_cols[i % sizeof(typing_cols)];
+    } while (free_at[row][col] > time);
+    uint32_t hold = 60 + randomNumber(71);
+
+    if (chord_every != 0 && n % chord_every == chord_every - 1 && !isQukey(row, col)) {
+      byte mod_col = (col < COLS / 2) ? 11 : 4;
+      uint32_t press_time = time + 40 + randomNumber(61);
+      if (free_at[2][mod_col] <= time) {
+        uint32_t release_time = press_time + hold + 20 + randomNumber(41);
+        addKeystroke(trace, time, release_time, 2, mod_col, INTENT_HOLD);
+        free_at[2][mod_col] = release_time + 1;
+        time = press_time;
+      }
+    }
+
+    addKeystroke(trace, time, time + hold, row, col,
+                 isQukey(row, col) ? INTENT_TAP : INTENT_NONE);
+    free_at[row][col] = time + hold + 1;
+    // Intervals vary by up to 40% either way
+    time += interval * 6 / 10 + randomNumber(interval * 8 / 10 + 1);
+  }
+  std::stable_sort(trace.events.begin(), trace.events.end(),
+  [](const TraceEvent & a, const TraceEvent & b) {
+    return a.time < b.time;
+  });
+  return trace;
+}
+
+static bool readTrace(const char *filename, Trace &trace) {
+  FILE *file = fopen(filename, "r");
+  if (file == NULL) {
+    perror(filename);
+    return false;
+  }
+  trace.name = filename;
+  char line[128];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    unsigned long time;
+    char type;
+    unsigned row, col;
+    char intent[8] = "";
+    if (line[0] == '#' ||
+        sscanf(line, "%lu %c %u %u %7s", &time, &type, &row, &col, intent) < 4)
+      continue;
+    if (row >= ROWS || col >= COLS)
+      continue;
+    TraceEvent event = {(uint32_t)time, (byte)row, (byte)col, type == 'p', INTENT_NONE};
+    if (strcmp(intent, "tap") == 0)
+      event.intent = INTENT_TAP;
+    else if (strcmp(intent, "hold") == 0)
+      event.intent = INTENT_HOLD;
+    trace.events.push_back(event);
+  }
+  fclose(file);
+  std::stable_sort(trace.events.begin(), trace.events.end(),
+  [](const TraceEvent & a, const TraceEvent & b) {
+    return a.time < b.time;
+  });
+  return true;
+}
+
+// What each qukey press was meant to do, until it's resolved
+static int8_t intents[TOTAL_KEYS];
+static uint32_t labelled_count;
+static uint32_t misresolved_count;
+
+static void qukeyResolved(byte row, byte col, Key, bool qukey_state, uint16_t) {
+  uint8_t key_addr = kaleidoscope::addr::addr(row, col);
+  if (intents[key_addr] == INTENT_NONE)
+    return;
+  labelled_count++;
+  if (qukey_state != (intents[key_addr] == INTENT_HOLD))
+    misresolved_count++;
+  intents[key_addr] = INTENT_NONE;
+}
+
+struct Result {
+  uint32_t reports;
+  uint32_t cycles;
+  double seconds;
+};
+
+static Result replay(const Trace &trace, bool use_qukeys, uint8_t policy, uint16_t timeout) {
+  vk::reset();
+  setupKeymap();
+  if (use_qukeys) {
+    setupQukeys(policy, timeout);
+    Qukeys.setResolveCallback(qukeyResolved);
+  }
+  memset(intents, INTENT_NONE, sizeof(intents));
+  labelled_count = 0;
+  misresolved_count = 0;
+
+  vk::scanCycle();
+  uint32_t start_time = vk::now();
+  // Each scan cycle takes one millisecond
+  auto start = std::chrono::steady_clock::now();
+  for (const TraceEvent &event : trace.events) {
+    while (vk::now() < start_time + event.time)
+      vk::scanCycle();
+    vk::setKeyswitch(event.row, event.col, event.pressed);
+    if (event.pressed)
+      intents[kaleidoscope::addr::addr(event.row, event.col)] = event.intent;
+  }
+  vk::releaseAll();
+  vk::scanCycles(1000);
+  auto end = std::chrono::steady_clock::now();
+
+  Result result;
+  result.reports = vk::reportCount();
+  result.cycles = vk::now() - start_time;
+  result.seconds = std::chrono::duration<double>(end - start).count();
+  return result;
+}
+
+int main(int argc, char **argv) {
+  uint8_t policy = QUKEYS_RESOLVE_ON_RELEASE;
+  uint16_t timeout = 250;
+  int repeats = 5;
+  std::vector<Trace> traces;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      policy = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      timeout = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      repeats = std::max(1, atoi(argv[++i]));
+    } else {
+      Trace trace;
+      if (!readTrace(argv[i], trace))
+        return 1;
+      traces.push_back(trace);
+    }
+  }
+  if (traces.empty()) {
+    traces.push_back(syntheticTrace("roll-80wpm", 80, 0, 4000));
+    traces.push_back(syntheticTrace("roll-120wpm", 120, 0, 4000));
+    traces.push_back(syntheticTrace("roll-160wpm", 160, 0, 4000));
+    traces.push_back(syntheticTrace("chords-120wpm", 120, 8, 4000));
+  }
+
+  printf("resolution policy %d, timeout %dms\n", policy, timeout);
+  printf("%-16s %8s %8s %20s %9s %8s\n",
+         "trace", "events", "reports", "misresolved", "ns/event", "ns/scan");
+  for (const Trace &trace : traces) {
+    double qukeys_time = 0, bare_time = 0;
+    Result result;
+    for (int i = 0; i < repeats; i++) {
+      Result bare = replay(trace, false, policy, timeout);
+      result = replay(trace, true, policy, timeout);
+      if (i == 0 || bare.seconds < bare_time)
+        bare_time = bare.seconds;
+      if (i == 0 || result.seconds < qukeys_time)
+        qukeys_time = result.seconds;
+    }
+    char misresolved[32] = "-";
+    if (labelled_count != 0)
+      snprintf(misresolved, sizeof(misresolved), "%u/%u (%.1f%%)", misresolved_count,
+               labelled_count, 100.0 * misresolved_count / labelled_count);
+    double qukeys_ns = (qukeys_time - bare_time) * 1e9;
+    printf("%-16s %8zu %8u %20s %9.0f %8.1f\n", trace.name.c_str(), trace.events.size(),
+           result.reports, misresolved, qukeys_ns / trace.events.size(),
+           qukeys_ns / result.cycles);
+  }
+  return 0;
+}
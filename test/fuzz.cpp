@@ -0,0 +1,354 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Feeds random keystrokes through Qukeys on the virtual keyboard and
+// checks that it holds together:
+//  - checkInvariants() has to pass after every scan cycle;
+//  - every so often it releases all the keys and waits for the queue to
+//    empty, and then no key may still be queued or in the report, and a
+//    plain key pressed on its own must show up in the next report;
+//  - with the default settings (phase A), the reports Qukeys sends have
+//    to match the ones from the reference model, report for report and
+//    millisecond for millisecond.
+// In phase B, it also turns on everything the model doesn't cover:
+// the other resolution and overflow policies, combos, quick taps, the
+// adaptive timeout, DualUse keys and a qukey that shifts layers.
+//
+// Usage: fuzz [-s seed] [-n steps]
+//
+// The same seed gives the same keystrokes (and the same result) on any
+// machine; a failure prints the seed and the last few events.
+
+#include <Kaleidoscope-Qukeys.h>
+#include "virtual_keyboard.h"
+#include "reference_model.h"
+
+#include <stdlib.h>
+#include <vector>
+
+namespace vk = virtual_keyboard;
+
+static uint32_t random_state;
+static uint32_t randomNumber(uint32_t limit) {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state % limit;
+}
+
+struct FuzzKey {
+  byte row;
+  byte col;
+};
+
+// The keys that get pressed: (0,0) is the plain key used to check that
+// nothing is blocked, and in phase B (2,10) and (2,14) are DualUse keys
+static const FuzzKey fuzz_keys[] = {
+  {0, 0}, {0, 1}, {0, 2},
+  {2, 1}, {2, 2}, {2, 3}, {2, 4}, {2, 5}, {2, 6},
+  {2, 10}, {2, 11}, {2, 12}, {2, 13}, {2, 14},
+};
+#define FUZZ_KEYS (sizeof(fuzz_keys) / sizeof(fuzz_keys[0]))
+#define PROBE_ROW 0
+#define PROBE_COL 0
+
+static const uint16_t timeouts[] = {20, 100, 250, 600};
+#define TIMEOUTS (sizeof(timeouts) / sizeof(timeouts[0]))
+
+static ReferenceModel model;
+static std::vector<TimedReport> qukeys_reports;
+static size_t compared_count;
+static size_t matched_count;
+static bool compare_reports;
+
+static void reportSent(const HID_KeyboardReport_Data_t &report, uint32_t time) {
+  TimedReport timed_report = {time, report};
+  qukeys_reports.push_back(timed_report);
+}
+
+// The last few events, to print if something goes wrong
+struct FuzzEvent {
+  uint32_t time;
+  byte row;
+  byte col;
+  bool pressed;
+};
+#define HISTORY_SIZE 24
+static FuzzEvent history[HISTORY_SIZE];
+static uint32_t event_count;
+
+static uint32_t seed;
+static uint32_t step;
+
+static void printReport(const char *name, const TimedReport *report) {
+  printf("  %-9s", name);
+  if (report == NULL) {
+    printf(" none\n");
+    return;
+  }
+  printf(" %u:", report->time);
+  for (uint8_t i = 0; i < sizeof(report->report.allkeys); i++)
+    printf(" %02x", report->report.allkeys[i]);
+  printf("\n");
+}
+
+static void fail(const char *what) {
+  printf("seed %u, step %u, time %u: %s\n", seed, step, vk::now(), what);
+  printf("  last events:\n");
+  uint32_t first = event_count > HISTORY_SIZE ? event_count - HISTORY_SIZE : 0;
+  for (uint32_t i = first; i < event_count; i++) {
+    const FuzzEvent &event = history[i % HISTORY_SIZE];
+    printf("    %u %c %u %u\n", event.time, event.pressed ? 'p' : 'r', event.row, event.col);
+  }
+  exit(1);
+}
+
+static void setKeyswitch(byte row, byte col, bool pressed) {
+  FuzzEvent event = {vk::now(), row, col, pressed};
+  history[event_count++ % HISTORY_SIZE] = event;
+  vk::setKeyswitch(row, col, pressed);
+  model.setKeyswitch(row, col, pressed);
+}
+
+static void scanCycle(void) {
+  uint32_t time = vk::now();
+  vk::scanCycle();
+  if (!Qukeys.checkInvariants())
+    fail("invariants don't hold");
+  if (!compare_reports)
+    return;
+  model.scanCycle(time);
+  const std::vector<TimedReport> &expected = model.reports();
+  while (compared_count < qukeys_reports.size() || compared_count < expected.size()) {
+    const TimedReport *actual = NULL, *wanted = NULL;
+    if (compared_count < qukeys_reports.size())
+      actual = &qukeys_reports[compared_count];
+    if (compared_count < expected.size())
+      wanted = &expected[compared_count];
+    if (actual == NULL || wanted == NULL || actual->time != wanted->time ||
+        memcmp(&actual->report, &wanted->report, sizeof(actual->report)) != 0) {
+      printReport("expected", wanted);
+      printReport("got", actual);
+      fail("reports differ from the reference model");
+    }
+    compared_count++;
+    matched_count++;
+  }
+}
+
+static void scanCycles(uint32_t count) {
+  while (count-- > 0)
+    scanCycle();
+}
+
+// Release everything and wait until nothing can still be pending, then
+// check nothing is stuck, and that a plain key isn't blocked
+static void settle(void) {
+  for (uint8_t i = 0; i < FUZZ_KEYS; i++) {
+    if (vk::keyswitch(fuzz_keys[i].row, fuzz_keys[i].col))
+      setKeyswitch(fuzz_keys[i].row, fuzz_keys[i].col, false);
+  }
+  scanCycles(1100);
+  for (uint8_t i = 0; i < FUZZ_KEYS; i++) {
+    if (Qukeys.state(fuzz_keys[i].row, fuzz_keys[i].col) == QUKEY_STATE_PENDING)
+      fail("a key is still queued after everything was released");
+  }
+  if (!vk::reportIsEmpty(vk::lastReport()))
+    fail("a key is stuck in the report after everything was released");
+  if (Layer.getLayerState() != 1)
+    fail("a layer is stuck on after everything was released");
+
+  setKeyswitch(PROBE_ROW, PROBE_COL, true);
+  scanCycle();
+  HID_KeyboardReport_Data_t probe;
+  memset(&probe, 0, sizeof(probe));
+  probe.keys[Key_A.keyCode / 8] |= 1 << (Key_A.keyCode % 8);
+  if (memcmp(&vk::lastReport(), &probe, sizeof(probe)) != 0)
+    fail("a plain key pressed on its own didn't show up in the report");
+  setKeyswitch(PROBE_ROW, PROBE_COL, false);
+  scanCycle();
+  if (!vk::reportIsEmpty(vk::lastReport()))
+    fail("a plain key released on its own stayed in the report");
+}
+
+static void setupKeymap(bool extended) {
+  vk::reset();
+  vk::setKey(0, 0, 0, Key_A);
+  vk::setKey(0, 0, 1, Key_B);
+  vk::setKey(0, 0, 2, Key_C);
+  vk::setKey(0, 2, 1, Key_D);
+  vk::setKey(0, 2, 2, Key_E);
+  vk::setKey(0, 2, 3, Key_F);
+  vk::setKey(0, 2, 4, Key_G);
+  vk::setKey(0, 2, 5, Key_H);
+  vk::setKey(0, 2, 6, Key_I);
+  vk::setKey(0, 2, 10, Key_J);
+  vk::setKey(0, 2, 11, Key_K);
+  vk::setKey(0, 2, 12, Key_L);
+  vk::setKey(0, 2, 13, Key_M);
+  vk::setKey(0, 2, 14, Key_N);
+  if (!extended)
+    return;
+#ifndef QUKEYS_DISABLE_DUAL_USE
+  // MT(LeftShift, J) and LT(1, N), without the narrowing warnings
+  vk::setKey(0, 2, 10, KEY((uint16_t)(kaleidoscope::ranges::DUM_FIRST + (1 << 8) + Key_J.keyCode)));
+  vk::setKey(0, 2, 14, KEY((uint16_t)(kaleidoscope::ranges::DUL_FIRST + (1 << 8) + Key_N.keyCode)));
+#endif
+  vk::setKey(1, 0, 1, Key_1);
+  vk::setKey(1, 0, 2, Key_2);
+  vk::setKey(1, 2, 6, Key_3);
+}
+
+// Phase A: the default settings, and only qukeys with modifiers for
+// their alternate keycodes, checked against the model
+static void setupPhaseA(uint16_t timeout) {
+  setupKeymap(false);
+  Qukeys.begin();
+  QUKEYS(
+    kaleidoscope::Qukey(QUKEY_ALL_LAYERS, 2, 1, Key_LeftGui),
+    kaleidoscope::Qukey(0, 2, 2, Key_LeftAlt),
+    kaleidoscope::Qukey(0, 2, 3, Key_LeftControl),
+    kaleidoscope::Qukey(0, 2, 4, Key_LeftShift),
+    kaleidoscope::Qukey(0, 2, 12, Key_RightControl),
+    kaleidoscope::Qukey(QUKEY_ALL_LAYERS, 2, 13, Key_RightAlt)
+  )
+  Qukeys.combos_count = 0;
+  Qukeys.indexQukeys();
+  Qukeys.setResolutionPolicy(QUKEYS_RESOLVE_ON_RELEASE);
+  Qukeys.setOverflowPolicy(QUKEYS_OVERFLOW_FLUSH_PRIMARY);
+  Qukeys.setTimeout(timeout);
+  Qukeys.setAdaptiveTimeout(0, 0);
+  Qukeys.setQuickTapTimeout(0);
+  Qukeys.setDualUseModifierTimeout(0);
+  Qukeys.setDualUseLayerTimeout(0);
+  vk::setReportCallback(reportSent);
+
+  model.reset(timeout, QUKEYS_QUEUE_MAX);
+  for (uint8_t i = 0; i < FUZZ_KEYS; i++) {
+    byte row = fuzz_keys[i].row, col = fuzz_keys[i].col;
+    model.setKey(row, col, Layer.lookup(row, col), Key_NoKey);
+  }
+  model.setKey(2, 1, Key_D, Key_LeftGui);
+  model.setKey(2, 2, Key_E, Key_LeftAlt);
+  model.setKey(2, 3, Key_F, Key_LeftControl);
+  model.setKey(2, 4, Key_G, Key_LeftShift);
+  model.setKey(2, 12, Key_L, Key_RightControl);
+  model.setKey(2, 13, Key_M, Key_RightAlt);
+  qukeys_reports.clear();
+  compared_count = 0;
+}
+
+// Phase B: everything else, picked at random
+static void setupPhaseB(void) {
+  setupKeymap(true);
+  Qukeys.begin();
+  QUKEYS(
+    kaleidoscope::Qukey(QUKEY_ALL_LAYERS, 2, 1, Key_LeftGui),
+    kaleidoscope::Qukey(0, 2, 2, Key_LeftAlt),
+#ifdef QUKEYS_PER_KEY_TIMEOUTS
+    kaleidoscope::Qukey(0, 2, 3, Key_LeftControl, 120),
+#else
+    kaleidoscope::Qukey(0, 2, 3, Key_LeftControl),
+#endif
+    kaleidoscope::Qukey(0, 2, 4, Key_LeftShift),
+    kaleidoscope::Qukey(0, 2, 5, ShiftToLayer(1)),
+    kaleidoscope::Qukey(1, 2, 6, Key_RightShift),
+    kaleidoscope::Qukey(0, 2, 12, Key_RightControl),
+    kaleidoscope::Qukey(QUKEY_ALL_LAYERS, 2, 13, Key_RightAlt)
+  )
+  QUKEY_COMBOS(
+    kaleidoscope::QukeyCombo(Key_Escape, 2, 12, 2, 13),
+    kaleidoscope::QukeyCombo(Key_Tab, 0, 1, 0, 2, 2, 11)
+  )
+  if (randomNumber(3) == 0) {
+    Qukeys.combos_count = 0;
+    Qukeys.indexQukeys();
+  }
+  Qukeys.setResolutionPolicy(randomNumber(4));
+  Qukeys.setOverflowPolicy(randomNumber(3));
+  Qukeys.setTimeout(timeouts[randomNumber(TIMEOUTS)]);
+  Qukeys.setComboTimeout(20 + randomNumber(60));
+  if (randomNumber(2) == 0) {
+    Qukeys.setAdaptiveTimeout(60 + randomNumber(60), 200 + randomNumber(300));
+  } else {
+    Qukeys.setAdaptiveTimeout(0, 0);
+  }
+  Qukeys.setQuickTapTimeout(randomNumber(2) == 0 ? 0 : 150);
+  Qukeys.setDualUseModifierTimeout(randomNumber(2) == 0 ? 0 : 180);
+  Qukeys.setDualUseLayerTimeout(randomNumber(2) == 0 ? 0 : 300);
+}
+
+// Press or release a random key, then wait: usually a cycle or two, so
+// there's plenty of overlap, but sometimes long enough for a timeout
+static void randomStep(uint16_t timeout) {
+  const FuzzKey &key = fuzz_keys[randomNumber(FUZZ_KEYS)];
+  setKeyswitch(key.row, key.col, !vk::keyswitch(key.row, key.col));
+  if (randomNumber(8) == 0) {
+    scanCycles(1 + randomNumber(timeout + 100));
+  } else {
+    scanCycles(randomNumber(3));
+  }
+}
+
+int main(int argc, char **argv) {
+  seed = 1;
+  uint32_t steps = 50000;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      seed = strtoul(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      steps = strtoul(argv[++i], NULL, 0);
+    } else {
+      printf("usage: fuzz [-s seed] [-n steps]\n");
+      return 1;
+    }
+  }
+  // xorshift gets stuck on zero
+  random_state = seed * 2654435761u + 1;
+
+  compare_reports = true;
+  uint16_t timeout = 0;
+  uint32_t segment_end = 0;
+  for (step = 0; step < steps; step++) {
+    if (step == segment_end) {
+      if (step != 0)
+        settle();
+      timeout = timeouts[randomNumber(TIMEOUTS)];
+      setupPhaseA(timeout);
+      segment_end = step + 200 + randomNumber(2000);
+    }
+    randomStep(timeout);
+  }
+  settle();
+  printf("phase A: %u steps, %zu reports matched the model\n", steps, matched_count);
+
+  compare_reports = false;
+  segment_end = 0;
+  for (step = 0; step < steps; step++) {
+    if (step == segment_end) {
+      if (step != 0)
+        settle();
+      setupPhaseB();
+      segment_end = step + 200 + randomNumber(2000);
+    }
+    randomStep(600);
+  }
+  settle();
+  printf("phase B: %u steps, no errors\n", steps);
+  return 0;
+}
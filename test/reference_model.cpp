@@ -0,0 +1,144 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "reference_model.h"
+#include <addr.h>
+
+static void addKeycode(HID_KeyboardReport_Data_t &report, Key key) {
+  if (key.keyCode >= 0xE0 && key.keyCode <= 0xE7) {
+    report.modifiers |= 1 << (key.keyCode - 0xE0);
+  } else if (key.keyCode != 0) {
+    report.keys[key.keyCode / 8] |= 1 << (key.keyCode % 8);
+  }
+}
+
+void ReferenceModel::reset(uint16_t timeout, uint8_t queue_max) {
+  timeout_ = timeout;
+  queue_max_ = queue_max;
+  for (uint8_t addr = 0; addr < MODEL_KEYS; addr++) {
+    primary_[addr] = Key_NoKey;
+    alternate_[addr] = Key_NoKey;
+    alternate_state_[addr] = false;
+    pressed_[addr] = false;
+    was_pressed_[addr] = false;
+  }
+  queue_.clear();
+  memset(&current_, 0, sizeof(current_));
+  memset(&last_sent_, 0, sizeof(last_sent_));
+  reports_.clear();
+}
+
+void ReferenceModel::setKey(byte row, byte col, Key primary, Key alternate) {
+  primary_[kaleidoscope::addr::addr(row, col)] = primary;
+  alternate_[kaleidoscope::addr::addr(row, col)] = alternate;
+}
+
+void ReferenceModel::setKeyswitch(byte row, byte col, bool pressed) {
+  pressed_[kaleidoscope::addr::addr(row, col)] = pressed;
+}
+
+int ReferenceModel::queueIndex(uint8_t addr) const {
+  for (size_t i = 0; i < queue_.size(); i++) {
+    if (queue_[i].addr == addr)
+      return i;
+  }
+  return -1;
+}
+
+// In compact mode, Qukeys only knows press times to the nearest 4ms
+uint32_t ReferenceModel::dwellTime(const Queued &queued) const {
+#ifdef QUKEYS_COMPACT_QUEUE
+  return (uint8_t)(time_ / 4 - queued.time / 4) * 4;
+#else
+  return time_ - queued.time;
+#endif
+}
+
+// Resolve the key at the head of the queue. Its keycode is reported on
+// top of the last report right away, and stays in the current one if
+// the key is still held.
+void ReferenceModel::flush(bool alternate, bool held) {
+  uint8_t addr = queue_.front().addr;
+  queue_.pop_front();
+  if (isQukey(addr))
+    alternate_state_[addr] = alternate;
+  HID_KeyboardReport_Data_t report = last_sent_;
+  addKeycode(report, keycode(addr));
+  send(report);
+  if (held)
+    addKeycode(current_, keycode(addr));
+}
+
+void ReferenceModel::enqueue(uint8_t addr) {
+  if (queue_.size() == queue_max_) {
+    flush(false, true);
+    while (!queue_.empty() && !isQukey(queue_.front().addr))
+      flush(false, true);
+  }
+  Queued queued = {addr, time_};
+  queue_.push_back(queued);
+}
+
+void ReferenceModel::send(const HID_KeyboardReport_Data_t &report) {
+  if (memcmp(&report, &last_sent_, sizeof(report)) == 0)
+    return;
+  last_sent_ = report;
+  TimedReport timed_report = {time_, report};
+  reports_.push_back(timed_report);
+}
+
+void ReferenceModel::scanCycle(uint32_t time) {
+  time_ = time;
+  memset(&current_, 0, sizeof(current_));
+  for (uint8_t addr = 0; addr < MODEL_KEYS; addr++) {
+    bool pressed = pressed_[addr];
+    bool was_pressed = was_pressed_[addr];
+    was_pressed_[addr] = pressed;
+    if (pressed && !was_pressed) {
+      if (queue_.empty() && !isQukey(addr)) {
+        addKeycode(current_, primary_[addr]);
+      } else {
+        enqueue(addr);
+      }
+    } else if (pressed) {
+      if (queueIndex(addr) < 0)
+        addKeycode(current_, keycode(addr));
+    } else if (was_pressed) {
+      // Releasing a queued key resolves the qukeys ahead of it
+      int index = queueIndex(addr);
+      if (index >= 0) {
+        for (int i = 0; i < index; i++)
+          flush(true, true);
+        flush(false, false);
+      }
+    }
+  }
+  // After the scan, qukeys that have timed out get their alternate
+  // keycodes, and any keys behind them are let go
+  while (!queue_.empty()) {
+    const Queued &head = queue_.front();
+    if (isQukey(head.addr)) {
+      if (dwellTime(head) <= timeout_)
+        break;
+      flush(true, true);
+    } else {
+      flush(false, true);
+    }
+  }
+  send(current_);
+}
@@ -0,0 +1,87 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <Kaleidoscope.h>
+#include <MultiReport/Keyboard.h>
+#include <deque>
+#include <vector>
+
+// A model of what Qukeys does with its default settings: a qukey gets
+// its alternate keycode if it's held past the timeout, or if a key
+// pressed after it is released first; otherwise it's a tap. Keys are
+// held in the queue until the qukeys ahead of them are resolved, then
+// reported in the order they were pressed, and a full queue flushes its
+// oldest key as primary. There are no combos, quick taps, DualUse keys
+// or layer shifts.
+//
+// It's deliberately simple (and slow), with none of Qukeys' own data
+// structures, so the fuzzer can compare the reports the two of them
+// send for the same keystrokes.
+#define MODEL_KEYS (ROWS * COLS)
+
+struct TimedReport {
+  uint32_t time;
+  HID_KeyboardReport_Data_t report;
+};
+
+class ReferenceModel {
+ public:
+  void reset(uint16_t timeout, uint8_t queue_max);
+  // An alternate keycode of Key_NoKey makes it an ordinary key
+  void setKey(byte row, byte col, Key primary, Key alternate);
+  void setKeyswitch(byte row, byte col, bool pressed);
+  // Scan the keyswitches at `time` (the time the virtual keyboard scans
+  // them) and send the report
+  void scanCycle(uint32_t time);
+  const std::vector<TimedReport> &reports(void) const {
+    return reports_;
+  }
+
+ private:
+  struct Queued {
+    uint8_t addr;
+    uint32_t time;
+  };
+
+  uint16_t timeout_;
+  uint8_t queue_max_;
+  Key primary_[MODEL_KEYS];
+  Key alternate_[MODEL_KEYS];
+  bool alternate_state_[MODEL_KEYS];
+  bool pressed_[MODEL_KEYS];
+  bool was_pressed_[MODEL_KEYS];
+  std::deque<Queued> queue_;
+  uint32_t time_;
+  HID_KeyboardReport_Data_t current_;
+  HID_KeyboardReport_Data_t last_sent_;
+  std::vector<TimedReport> reports_;
+
+  bool isQukey(uint8_t addr) const {
+    return alternate_[addr] != Key_NoKey;
+  }
+  Key keycode(uint8_t addr) const {
+    return (isQukey(addr) && alternate_state_[addr]) ? alternate_[addr] : primary_[addr];
+  }
+  int queueIndex(uint8_t addr) const;
+  uint32_t dwellTime(const Queued &queued) const;
+  void flush(bool alternate, bool held);
+  void enqueue(uint8_t addr);
+  void send(const HID_KeyboardReport_Data_t &report);
+};
@@ -0,0 +1,173 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Scripted keystrokes for cases the fuzzer can't judge on its own (it
+// only compares reports with the model for the default settings): each
+// scenario sets up a keymap, plays a sequence of presses and releases,
+// and checks the reports that come out. A failing scenario is printed
+// with what went wrong, and the exit status is 1.
+
+#include <Kaleidoscope-Qukeys.h>
+#include "virtual_keyboard.h"
+
+#include <vector>
+
+namespace vk = virtual_keyboard;
+
+static std::vector<HID_KeyboardReport_Data_t> reports;
+
+static void reportSent(const HID_KeyboardReport_Data_t &report, uint32_t) {
+  reports.push_back(report);
+}
+
+static bool reportHasKey(const HID_KeyboardReport_Data_t &report, Key key) {
+  if (key.keyCode >= 0xE0 && key.keyCode <= 0xE7)
+    return bitRead(report.modifiers, key.keyCode - 0xE0);
+  return bitRead(report.keys[key.keyCode / 8], key.keyCode % 8);
+}
+
+// Was `key` in any report sent since the scenario started?
+static bool sentKey(Key key) {
+  for (const HID_KeyboardReport_Data_t &report : reports) {
+    if (reportHasKey(report, key))
+      return true;
+  }
+  return false;
+}
+
+static const char *failure;
+
+static void check(bool condition, const char *what) {
+  if (!condition && failure == NULL)
+    failure = what;
+}
+
+// Row 2, cols 1-4 are the usual home-row qukeys (D/gui, E/alt, F/ctrl,
+// G/shift), and col 5 shifts to layer 1 when held. Row 0 has plain
+// keys, which are numbers on layer 1.
+static void setup(void) {
+  vk::reset();
+  vk::setKey(0, 2, 1, Key_D);
+  vk::setKey(0, 2, 2, Key_E);
+  vk::setKey(0, 2, 3, Key_F);
+  vk::setKey(0, 2, 4, Key_G);
+  vk::setKey(0, 2, 5, Key_H);
+  vk::setKey(0, 0, 0, Key_A);
+  vk::setKey(0, 0, 1, Key_B);
+  vk::setKey(0, 0, 2, Key_C);
+  vk::setKey(1, 0, 1, Key_1);
+  vk::setKey(1, 0, 2, Key_2);
+  Qukeys.begin();
+  QUKEYS(
+    kaleidoscope::Qukey(0, 2, 1, Key_LeftGui),
+    kaleidoscope::Qukey(0, 2, 2, Key_LeftAlt),
+    kaleidoscope::Qukey(0, 2, 3, Key_LeftControl),
+    kaleidoscope::Qukey(0, 2, 4, Key_LeftShift),
+    kaleidoscope::Qukey(0, 2, 5, ShiftToLayer(1))
+  )
+  Qukeys.setTimeout(200);
+  Qukeys.setQuickTapTimeout(0);
+  vk::setReportCallback(reportSent);
+  reports.clear();
+  failure = NULL;
+}
+
+static void press(byte row, byte col) {
+  vk::setKeyswitch(row, col, true);
+  vk::scanCycles(5);
+}
+
+static void release(byte row, byte col) {
+  vk::setKeyswitch(row, col, false);
+  vk::scanCycles(5);
+}
+
+// A key queued behind a layer shift qukey is reported from the new
+// layer once the qukey resolves, even though the core only refreshes
+// its keymap cache when a key is pressed
+static void keyBehindLayerShift(void) {
+  press(2, 5);
+  press(0, 1);
+  release(0, 1);
+  release(2, 5);
+  check(sentKey(Key_1), "the key wasn't reported from layer 1");
+  check(!sentKey(Key_B), "the key was reported from layer 0");
+}
+
+// A quick tap re-press that has to wait behind another qukey stays
+// primary, like the resolve callback said it was
+static void quickTapBehindQukey(void) {
+  Qukeys.setQuickTapTimeout(150);
+  press(2, 1);
+  press(2, 5);
+  release(2, 1);
+  press(2, 1);
+  vk::scanCycles(250);
+  check(Qukeys.state(2, 1) == QUKEY_STATE_PRIMARY, "the re-pressed qukey isn't primary");
+  check(!sentKey(Key_LeftGui), "the re-pressed qukey was reported as alternate");
+  release(2, 1);
+  release(2, 5);
+}
+
+// Turning Qukeys off with keys in the queue doesn't let their events
+// through on their own, or leave them to time out after they've been
+// released
+static void deactivateWithKeysQueued(void) {
+  vk::setKey(0, 0, 3, Key_X);
+  press(2, 1);
+  press(0, 3);
+  Qukeys.deactivate();
+  vk::scanCycles(5);
+  check(!sentKey(Key_D) && !sentKey(Key_X), "keys still queued were reported");
+  release(0, 3);
+  release(2, 1);
+  reports.clear();
+  vk::scanCycles(300);
+  check(!sentKey(Key_X) && !sentKey(Key_LeftGui), "released keys were reported later");
+  Qukeys.activate();
+}
+
+struct Scenario {
+  const char *name;
+  void (*run)(void);
+};
+
+static const Scenario scenarios[] = {
+  {"key behind a layer shift", keyBehindLayerShift},
+  {"quick tap behind a qukey", quickTapBehindQukey},
+  {"deactivate with keys queued", deactivateWithKeysQueued},
+};
+
+int main(void) {
+  int failed = 0;
+  for (const Scenario &scenario : scenarios) {
+    setup();
+    (*scenario.run)();
+    vk::releaseAll();
+    vk::scanCycles(1100);
+    check(vk::reportIsEmpty(vk::lastReport()), "keys were left in the report");
+    check(Qukeys.checkInvariants(), "the invariants don't hold");
+    if (failure != NULL) {
+      printf("FAIL %s: %s\n", scenario.name, failure);
+      failed++;
+    } else {
+      printf("ok   %s\n", scenario.name);
+    }
+  }
+  return failed != 0;
+}
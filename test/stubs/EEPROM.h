@@ -0,0 +1,46 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// EEPROM, backed by an array in RAM
+#define EEPROM_SIZE 1024
+
+class EEPROMClass {
+ public:
+  uint8_t data[EEPROM_SIZE];
+
+  uint8_t read(int idx) {
+    return data[idx];
+  }
+  void update(int idx, uint8_t val) {
+    data[idx] = val;
+  }
+  template <typename T> T &get(int idx, T &t) {
+    memcpy(&t, &data[idx], sizeof(T));
+    return t;
+  }
+  template <typename T> const T &put(int idx, const T &t) {
+    memcpy(&data[idx], &t, sizeof(T));
+    return t;
+  }
+};
+extern EEPROMClass EEPROM;
@@ -0,0 +1,200 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// Just enough of Arduino and Kaleidoscope to build Qukeys on the host,
+// for the harnesses in this directory. The definitions are in
+// virtual_keyboard.cpp, which plays the part of the hardware and the
+// Kaleidoscope core.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+// A Model01-sized grid
+#define ROWS 4
+#define COLS 16
+
+uint32_t millis(void);
+uint32_t micros(void);
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+#define memcpy_P memcpy
+#define strcmp_P strcmp
+
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define bitWrite(value, bit, bitvalue) ((bitvalue) ? bitSet(value, bit) : bitClear(value, bit))
+
+class SerialPort {
+ public:
+  void print(const char *s);
+  void print(int n);
+  void print(unsigned int n);
+  void print(long n);
+  void print(unsigned long n);
+  void println(void);
+  void println(int n);
+  void println(unsigned int n);
+  void println(long n);
+  void println(unsigned long n);
+  int peek(void);
+  long parseInt(void);
+  int availableForWrite(void);
+  size_t write(uint8_t b);
+  size_t write(const uint8_t *buffer, size_t size);
+};
+extern SerialPort Serial;
+
+// Keyswitch states
+#define IS_PRESSED  0x01
+#define WAS_PRESSED 0x02
+#define INJECTED    0x80
+#define keyIsPressed(state)   ((state) & IS_PRESSED)
+#define keyWasPressed(state)  ((state) & WAS_PRESSED)
+#define keyToggledOn(state)   (keyIsPressed(state) && !keyWasPressed(state))
+#define keyToggledOff(state)  (keyWasPressed(state) && !keyIsPressed(state))
+
+// Keys
+typedef union Key_ {
+  struct {
+    uint8_t keyCode;
+    uint8_t flags;
+  };
+  uint16_t raw;
+
+  bool operator==(const Key_ &other) const {
+    return raw == other.raw;
+  }
+  bool operator!=(const Key_ &other) const {
+    return raw != other.raw;
+  }
+} Key;
+
+#define KEY_FLAGS        0x00
+#define CTRL_HELD        0x01
+#define LALT_HELD        0x02
+#define RALT_HELD        0x04
+#define SHIFT_HELD       0x08
+#define GUI_HELD         0x10
+#define SYNTHETIC        0x40
+#define RESERVED         0x80
+// Flags for synthetic keys
+#define SWITCH_TO_KEYMAP 0x04
+
+#define LAYER_SHIFT_OFFSET 42
+#define ShiftToLayer(n) (Key){ .raw = (uint16_t)(((SYNTHETIC | SWITCH_TO_KEYMAP) << 8) | (LAYER_SHIFT_OFFSET + (n))) }
+
+#define KEY(code) (Key){ .raw = (code) }
+#define Key_NoKey        KEY(0x0000)
+#define Key_Transparent  KEY(0xFFFF)
+#define Key_A            KEY(0x04)
+#define Key_B            KEY(0x05)
+#define Key_C            KEY(0x06)
+#define Key_D            KEY(0x07)
+#define Key_E            KEY(0x08)
+#define Key_F            KEY(0x09)
+#define Key_G            KEY(0x0A)
+#define Key_H            KEY(0x0B)
+#define Key_I            KEY(0x0C)
+#define Key_J            KEY(0x0D)
+#define Key_K            KEY(0x0E)
+#define Key_L            KEY(0x0F)
+#define Key_M            KEY(0x10)
+#define Key_N            KEY(0x11)
+#define Key_O            KEY(0x12)
+#define Key_P            KEY(0x13)
+#define Key_Q            KEY(0x14)
+#define Key_R            KEY(0x15)
+#define Key_S            KEY(0x16)
+#define Key_T            KEY(0x17)
+#define Key_U            KEY(0x18)
+#define Key_V            KEY(0x19)
+#define Key_W            KEY(0x1A)
+#define Key_X            KEY(0x1B)
+#define Key_Y            KEY(0x1C)
+#define Key_Z            KEY(0x1D)
+#define Key_1            KEY(0x1E)
+#define Key_2            KEY(0x1F)
+#define Key_3            KEY(0x20)
+#define Key_4            KEY(0x21)
+#define Key_5            KEY(0x22)
+#define Key_6            KEY(0x23)
+#define Key_7            KEY(0x24)
+#define Key_8            KEY(0x25)
+#define Key_9            KEY(0x26)
+#define Key_0            KEY(0x27)
+#define Key_Enter        KEY(0x28)
+#define Key_Escape       KEY(0x29)
+#define Key_Backspace    KEY(0x2A)
+#define Key_Tab          KEY(0x2B)
+#define Key_Spacebar     KEY(0x2C)
+#define Key_Minus        KEY(0x2D)
+#define Key_Equals       KEY(0x2E)
+#define Key_Semicolon    KEY(0x33)
+#define Key_Quote        KEY(0x34)
+#define Key_Comma        KEY(0x36)
+#define Key_Period       KEY(0x37)
+#define Key_Slash        KEY(0x38)
+#define Key_LeftControl  KEY(0xE0)
+#define Key_LeftShift    KEY(0xE1)
+#define Key_LeftAlt      KEY(0xE2)
+#define Key_LeftGui      KEY(0xE3)
+#define Key_RightControl KEY(0xE4)
+#define Key_RightShift   KEY(0xE5)
+#define Key_RightAlt     KEY(0xE6)
+#define Key_RightGui     KEY(0xE7)
+
+// The core
+class KaleidoscopePlugin {
+ public:
+  virtual void begin(void) = 0;
+};
+
+typedef Key (*eventHandlerHook)(Key mappedKey, byte row, byte col, uint8_t keyState);
+typedef void (*loopHook)(bool postClear);
+
+class Kaleidoscope_ {
+ public:
+  void useEventHandlerHook(eventHandlerHook hook);
+  void useLoopHook(loopHook hook);
+};
+extern Kaleidoscope_ Kaleidoscope;
+
+class Layer_ {
+ public:
+  static Key lookup(byte row, byte col);
+  static void updateLiveCompositeKeymap(byte row, byte col);
+  static uint8_t lookupActiveLayer(byte row, byte col);
+  static uint32_t getLayerState(void);
+  static void on(uint8_t layer);
+  static void off(uint8_t layer);
+};
+extern Layer_ Layer;
+
+void handleKeyswitchEvent(Key mappedKey, byte row, byte col, uint8_t keyState);
@@ -0,0 +1,283 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "virtual_keyboard.h"
+#include <kaleidoscope/hid.h>
+#include <Kaleidoscope-EEPROM-Settings.h>
+
+// Globals that the stub headers declare
+Kaleidoscope_ Kaleidoscope;
+Layer_ Layer;
+Keyboard_ Keyboard;
+SerialPort Serial;
+EEPROMClass EEPROM;
+EEPROMSettings_ EEPROMSettings;
+
+namespace virtual_keyboard {
+
+#define MAX_HOOKS 8
+
+static uint32_t now_ = 1000;
+static Key keymap_[VIRTUAL_LAYERS][ROWS][COLS];
+// Like Kaleidoscope's live composite keymap, this is only brought up to
+// date for a keyswitch when it's pressed (or when asked to)
+static Key live_keymap_[ROWS][COLS];
+static bool keyswitches_[ROWS][COLS];
+static bool previous_keyswitches_[ROWS][COLS];
+static uint32_t layer_state_ = 1;
+static eventHandlerHook event_hooks_[MAX_HOOKS];
+static uint8_t event_hook_count_ = 0;
+static loopHook loop_hooks_[MAX_HOOKS];
+static uint8_t loop_hook_count_ = 0;
+static uint32_t report_count_ = 0;
+static ReportCallback report_callback_ = NULL;
+
+void reset(void) {
+  for (uint8_t layer = 0; layer < VIRTUAL_LAYERS; layer++) {
+    for (byte row = 0; row < ROWS; row++) {
+      for (byte col = 0; col < COLS; col++) {
+        keymap_[layer][row][col] = (layer == 0) ? Key_NoKey : Key_Transparent;
+      }
+    }
+  }
+  memset(live_keymap_, 0, sizeof(live_keymap_));
+  memset(keyswitches_, 0, sizeof(keyswitches_));
+  memset(previous_keyswitches_, 0, sizeof(previous_keyswitches_));
+  layer_state_ = 1;
+  event_hook_count_ = 0;
+  loop_hook_count_ = 0;
+  report_count_ = 0;
+  report_callback_ = NULL;
+  memset(&Keyboard, 0, sizeof(Keyboard));
+}
+
+void setKey(uint8_t layer, byte row, byte col, Key key) {
+  keymap_[layer][row][col] = key;
+  Layer.updateLiveCompositeKeymap(row, col);
+}
+
+void setKeyswitch(byte row, byte col, bool pressed) {
+  keyswitches_[row][col] = pressed;
+}
+
+bool keyswitch(byte row, byte col) {
+  return keyswitches_[row][col];
+}
+
+void releaseAll(void) {
+  memset(keyswitches_, 0, sizeof(keyswitches_));
+}
+
+void scanCycle(void) {
+  for (byte row = 0; row < ROWS; row++) {
+    for (byte col = 0; col < COLS; col++) {
+      uint8_t key_state = (keyswitches_[row][col] ? IS_PRESSED : 0) |
+                          (previous_keyswitches_[row][col] ? WAS_PRESSED : 0);
+      previous_keyswitches_[row][col] = keyswitches_[row][col];
+      handleKeyswitchEvent(Key_NoKey, row, col, key_state);
+    }
+  }
+  for (uint8_t i = 0; i < loop_hook_count_; i++)
+    (*loop_hooks_[i])(false);
+  kaleidoscope::hid::sendKeyboardReport();
+  memset(Keyboard.keyReport.allkeys, 0, sizeof(Keyboard.keyReport));
+  now_++;
+  for (uint8_t i = 0; i < loop_hook_count_; i++)
+    (*loop_hooks_[i])(true);
+}
+
+void scanCycles(uint32_t count) {
+  while (count-- > 0)
+    scanCycle();
+}
+
+uint32_t now(void) {
+  return now_;
+}
+
+uint32_t reportCount(void) {
+  return report_count_;
+}
+
+const HID_KeyboardReport_Data_t &lastReport(void) {
+  return Keyboard.lastKeyReport;
+}
+
+void setReportCallback(ReportCallback callback) {
+  report_callback_ = callback;
+}
+
+bool reportIsEmpty(const HID_KeyboardReport_Data_t &report) {
+  for (uint8_t i = 0; i < sizeof(report.allkeys); i++) {
+    if (report.allkeys[i] != 0)
+      return false;
+  }
+  return true;
+}
+
+static void pressKey(Key key) {
+  if (key.keyCode >= Key_LeftControl.keyCode && key.keyCode <= Key_RightGui.keyCode) {
+    bitSet(Keyboard.keyReport.modifiers, key.keyCode - Key_LeftControl.keyCode);
+  } else if (key.keyCode != 0) {
+    bitSet(Keyboard.keyReport.keys[key.keyCode / 8], key.keyCode % 8);
+  }
+  if (key.flags & CTRL_HELD)
+    pressKey(Key_LeftControl);
+  if (key.flags & LALT_HELD)
+    pressKey(Key_LeftAlt);
+  if (key.flags & RALT_HELD)
+    pressKey(Key_RightAlt);
+  if (key.flags & SHIFT_HELD)
+    pressKey(Key_LeftShift);
+  if (key.flags & GUI_HELD)
+    pressKey(Key_LeftGui);
+}
+
+} // namespace virtual_keyboard {
+
+using namespace virtual_keyboard;
+
+uint32_t millis(void) {
+  return now_;
+}
+
+uint32_t micros(void) {
+  return now_ * 1000;
+}
+
+void Kaleidoscope_::useEventHandlerHook(eventHandlerHook hook) {
+  if (event_hook_count_ < MAX_HOOKS)
+    event_hooks_[event_hook_count_++] = hook;
+}
+
+void Kaleidoscope_::useLoopHook(loopHook hook) {
+  if (loop_hook_count_ < MAX_HOOKS)
+    loop_hooks_[loop_hook_count_++] = hook;
+}
+
+// The highest active layer that has something other than a transparent
+// key for this keyswitch
+uint8_t Layer_::lookupActiveLayer(byte row, byte col) {
+  for (int8_t layer = VIRTUAL_LAYERS - 1; layer > 0; layer--) {
+    if (bitRead(layer_state_, layer) && keymap_[layer][row][col] != Key_Transparent)
+      return layer;
+  }
+  return 0;
+}
+
+void Layer_::updateLiveCompositeKeymap(byte row, byte col) {
+  live_keymap_[row][col] = keymap_[lookupActiveLayer(row, col)][row][col];
+}
+
+Key Layer_::lookup(byte row, byte col) {
+  return live_keymap_[row][col];
+}
+
+uint32_t Layer_::getLayerState(void) {
+  return layer_state_;
+}
+
+void Layer_::on(uint8_t layer) {
+  bitSet(layer_state_, layer);
+}
+
+void Layer_::off(uint8_t layer) {
+  if (layer != 0)
+    bitClear(layer_state_, layer);
+}
+
+// As in Kaleidoscope: look the key up (unless it's given, and only
+// refreshing it from the layers if it was just pressed), pass it
+// through the plugins' hooks, then handle layer shifts and add
+// keycodes to the report
+void handleKeyswitchEvent(Key mappedKey, byte row, byte col, uint8_t keyState) {
+  if (mappedKey == Key_NoKey) {
+    if (keyToggledOn(keyState))
+      Layer.updateLiveCompositeKeymap(row, col);
+    mappedKey = Layer.lookup(row, col);
+  }
+  for (uint8_t i = 0; i < event_hook_count_; i++) {
+    mappedKey = (*event_hooks_[i])(mappedKey, row, col, keyState);
+    if (mappedKey == Key_NoKey)
+      return;
+  }
+  if (mappedKey == Key_Transparent)
+    return;
+  if (mappedKey.flags & SYNTHETIC) {
+    if ((mappedKey.flags & SWITCH_TO_KEYMAP) && mappedKey.keyCode >= LAYER_SHIFT_OFFSET) {
+      uint8_t layer = mappedKey.keyCode - LAYER_SHIFT_OFFSET;
+      if (keyToggledOff(keyState)) {
+        Layer.off(layer);
+      } else if (keyIsPressed(keyState)) {
+        Layer.on(layer);
+      }
+    }
+    return;
+  }
+  if (keyIsPressed(keyState))
+    pressKey(mappedKey);
+}
+
+namespace kaleidoscope {
+namespace hid {
+
+void sendKeyboardReport(void) {
+  if (memcmp(Keyboard.keyReport.allkeys, Keyboard.lastKeyReport.allkeys,
+             sizeof(Keyboard.keyReport)) == 0)
+    return;
+  memcpy(Keyboard.lastKeyReport.allkeys, Keyboard.keyReport.allkeys,
+         sizeof(Keyboard.keyReport));
+  report_count_++;
+  if (report_callback_ != NULL)
+    (*report_callback_)(Keyboard.lastKeyReport, now_);
+}
+
+} // namespace hid {
+} // namespace kaleidoscope {
+
+// The serial port goes nowhere; it always has room, and never has
+// anything to read
+void SerialPort::print(const char *) {}
+void SerialPort::print(int) {}
+void SerialPort::print(unsigned int) {}
+void SerialPort::print(long) {}
+void SerialPort::print(unsigned long) {}
+void SerialPort::println(void) {}
+void SerialPort::println(int) {}
+void SerialPort::println(unsigned int) {}
+void SerialPort::println(long) {}
+void SerialPort::println(unsigned long) {}
+int SerialPort::peek(void) {
+  return '\n';
+}
+long SerialPort::parseInt(void) {
+  return 0;
+}
+int SerialPort::availableForWrite(void) {
+  return 64;
+}
+size_t SerialPort::write(uint8_t) {
+  return 1;
+}
+size_t SerialPort::write(const uint8_t *, size_t size) {
+  return size;
+}
+
+uint16_t EEPROMSettings_::requestSlice(uint16_t) {
+  return 0;
+}
@@ -0,0 +1,57 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <Kaleidoscope.h>
+#include <MultiReport/Keyboard.h>
+
+// A keyboard on the host: a keymap, a key matrix that's scanned once
+// per (virtual) millisecond, and the HID reports that come out of it.
+// Each scan goes through the same steps as Kaleidoscope's loop():
+// handleKeyswitchEvent() for every keyswitch, the loop hooks, sending
+// the report, then the loop hooks again.
+namespace virtual_keyboard {
+
+#define VIRTUAL_LAYERS 4
+
+typedef void (*ReportCallback)(const HID_KeyboardReport_Data_t &report, uint32_t time);
+
+// Clear the keymap (every layer but 0 becomes transparent), the
+// keyswitches, the layers, the plugin hooks and the report count. The
+// clock keeps going.
+void reset(void);
+void setKey(uint8_t layer, byte row, byte col, Key key);
+void setKeyswitch(byte row, byte col, bool pressed);
+bool keyswitch(byte row, byte col);
+void releaseAll(void);
+
+// Run one scan cycle, then advance the clock by a millisecond, before
+// the post-report loop hooks (so the time a plugin reads then is the
+// time the next scan happens)
+void scanCycle(void);
+void scanCycles(uint32_t count);
+uint32_t now(void);
+
+uint32_t reportCount(void);
+const HID_KeyboardReport_Data_t &lastReport(void);
+// Called for each report that's sent, with the time it was sent
+void setReportCallback(ReportCallback callback);
+bool reportIsEmpty(const HID_KeyboardReport_Data_t &report);
+
+} // namespace virtual_keyboard {